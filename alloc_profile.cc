@@ -0,0 +1,230 @@
+#include "alloc_profile.h"
+#include "fmt/core.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace cmp {
+
+thread_local AllocCategory alloc_category = AllocCategory::other;
+std::atomic<const char *> alloc_phase{nullptr};
+
+namespace {
+
+// Phases beyond this many are counted as no phase.
+constexpr size_t MAX_PHASES = 16;
+constexpr size_t CATEGORY_COUNT = static_cast<size_t>(AllocCategory::count);
+// Power-of-two size classes: [1, 2), [2, 4), ..., [2^31, inf).
+constexpr size_t SIZE_CLASSES = 32;
+
+const char *category_names[CATEGORY_COUNT] = {
+    "other", "parser", "NameTable", "ScopedTable", "fmt", "SourceLoc",
+};
+
+struct Counter {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+};
+
+// Everything here is constant-initialized, so that allocations made by the
+// static constructors of other files are counted too.  Row 0 of `counters` is
+// for allocations outside of any phase.
+std::atomic<const char *> phase_names[MAX_PHASES];
+Counter counters[MAX_PHASES][CATEGORY_COUNT];
+Counter size_classes[SIZE_CLASSES];
+std::atomic<uint64_t> frees;
+
+size_t phase_index(const char *phase) {
+    if (!phase) {
+        return 0;
+    }
+    for (size_t i = 1; i < MAX_PHASES; i++) {
+        const char *name = phase_names[i].load(std::memory_order_relaxed);
+        if (!name && phase_names[i].compare_exchange_strong(name, phase)) {
+            return i;
+        }
+        // The same phase may be named by different literals.
+        if (name == phase || strcmp(name, phase) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+size_t size_class(size_t size) {
+    size_t c = 0;
+    while (size > 1 && c + 1 < SIZE_CLASSES) {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
+
+void add(Counter &c, size_t size) {
+    c.count.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void count(size_t size) {
+    size_t phase = phase_index(alloc_phase.load(std::memory_order_relaxed));
+    add(counters[phase][static_cast<size_t>(alloc_category)], size);
+    add(size_classes[size_class(size)], size);
+}
+
+void *counted_alloc(size_t size) {
+    count(size);
+    // malloc(0) may return null.
+    return malloc(size ? size : 1);
+}
+
+void *counted_alloc(size_t size, std::align_val_t align) {
+    count(size);
+    void *p;
+    size_t alignment = std::max(static_cast<size_t>(align), sizeof(void *));
+    return posix_memalign(&p, alignment, size ? size : 1) == 0 ? p : nullptr;
+}
+
+void counted_free(void *p) {
+    if (p) {
+        frees.fetch_add(1, std::memory_order_relaxed);
+        free(p);
+    }
+}
+
+void print_profile() {
+    // Reading the counters does not stop them; what fmt allocates below is not
+    // worth excluding.
+    FILE *out = stderr;
+    uint64_t total_count = 0, total_bytes = 0;
+    fmt::print(out, "=== allocation profile ===\n");
+    fmt::print(out, "  {:<16} {:<12} {:>10} {:>12}\n", "phase", "category",
+               "allocs", "bytes");
+    for (size_t p = 0; p < MAX_PHASES; p++) {
+        const char *phase = p == 0 ? "(none)" : phase_names[p].load();
+        if (!phase) {
+            break;
+        }
+        for (size_t c = 0; c < CATEGORY_COUNT; c++) {
+            uint64_t count = counters[p][c].count.load();
+            uint64_t bytes = counters[p][c].bytes.load();
+            if (count == 0) {
+                continue;
+            }
+            fmt::print(out, "  {:<16} {:<12} {:>10} {:>12}\n", phase,
+                       category_names[c], count, bytes);
+            total_count += count;
+            total_bytes += bytes;
+        }
+    }
+    fmt::print(out, "  {:<29} {:>10} {:>12}\n", "total", total_count,
+               total_bytes);
+    fmt::print(out, "  {:<29} {:>10}\n", "frees", frees.load());
+
+    fmt::print(out, "  {:<29} {:>10} {:>12}\n", "size", "allocs", "bytes");
+    for (size_t c = 0; c < SIZE_CLASSES; c++) {
+        uint64_t count = size_classes[c].count.load();
+        if (count == 0) {
+            continue;
+        }
+        fmt::print(out, "  {:<29} {:>10} {:>12}\n",
+                   fmt::format("{}-{}", size_t{1} << c, (size_t{2} << c) - 1),
+                   count, size_classes[c].bytes.load());
+    }
+}
+
+// Prints the profile when the static objects are destroyed, i.e. when main()
+// returns or exit() is called.
+struct ProfilePrinter {
+    ~ProfilePrinter() { print_profile(); }
+} printer;
+
+} // namespace
+
+} // namespace cmp
+
+// Replacements of the global allocation functions.  All the forms are
+// replaced, not only the ones the standard library defines the others in
+// terms of, because the sanitizers define them all.  The aligned forms are
+// used for over-aligned types, such as the alignas(64) shards of the
+// concurrent tables.
+void *operator new(size_t size) {
+    if (void *p = cmp::counted_alloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return cmp::counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return cmp::counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept { cmp::counted_free(p); }
+
+void operator delete[](void *p) noexcept { cmp::counted_free(p); }
+
+void operator delete(void *p, size_t) noexcept { cmp::counted_free(p); }
+
+void operator delete[](void *p, size_t) noexcept { cmp::counted_free(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    cmp::counted_free(p);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    if (void *p = cmp::counted_alloc(size, align)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+void *operator new(size_t size, std::align_val_t align,
+                   const std::nothrow_t &) noexcept {
+    return cmp::counted_alloc(size, align);
+}
+
+void *operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t &) noexcept {
+    return cmp::counted_alloc(size, align);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete(void *p, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+    cmp::counted_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+    cmp::counted_free(p);
+}
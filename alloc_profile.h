@@ -0,0 +1,72 @@
+// -*- C++ -*-
+#ifndef CMP_ALLOC_PROFILE_H
+#define CMP_ALLOC_PROFILE_H
+
+#include <atomic>
+
+namespace cmp {
+
+// Allocation profiling of the compiler itself, for checking that the hot paths
+// do not allocate.  When built with RUSE_ALLOC_PROFILE, alloc_profile.cc
+// replaces the global operator new and delete with ones that count every
+// allocation against the phase that is running and the innermost
+// ALLOC_SCOPE category of the allocating thread, and prints a histogram at
+// exit.  Otherwise none of this is compiled in.
+//
+// malloc itself is not hooked, as glibc no longer has hooks for it and the
+// sanitizers interpose it; the compiler only calls it through operator new.
+enum class AllocCategory {
+    other,
+    parser,
+    name_table,
+    scoped_table,
+    fmt,
+    source_loc,
+    count,
+};
+
+// Category of the allocations made by the calling thread.
+extern thread_local AllocCategory alloc_category;
+
+// Phase of the compilation, as set by PhaseTimer.  This is process-wide so
+// that the typecheck workers are counted against the typecheck phase; with
+// several compilations in flight, as in batch mode, it is only approximate.
+extern std::atomic<const char *> alloc_phase;
+
+// Count the allocations of the enclosing scope as `category`.
+class AllocScope {
+public:
+    AllocScope(AllocCategory category) : saved{alloc_category} {
+        alloc_category = category;
+    }
+    ~AllocScope() { alloc_category = saved; }
+
+private:
+    AllocCategory saved;
+};
+
+// Count the allocations of the enclosing scope as made in `phase`.
+class AllocPhase {
+public:
+    AllocPhase(const char *phase) : saved{alloc_phase.exchange(phase)} {}
+    ~AllocPhase() { alloc_phase = saved; }
+
+private:
+    const char *saved;
+};
+
+} // namespace cmp
+
+#ifdef RUSE_ALLOC_PROFILE
+#define RUSE_ALLOC_CONCAT2(a, b) a##b
+#define RUSE_ALLOC_CONCAT(a, b) RUSE_ALLOC_CONCAT2(a, b)
+// ALLOC_SCOPE(category), where category is one of AllocCategory.
+#define ALLOC_SCOPE(category)                                                  \
+    ::cmp::AllocScope RUSE_ALLOC_CONCAT(alloc_scope_, __LINE__) {              \
+        ::cmp::AllocCategory::category                                         \
+    }
+#else
+#define ALLOC_SCOPE(category) ((void)0)
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include "ast.h"
 #include "sema.h"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <sstream>
@@ -25,4 +26,114 @@ std::optional<Type *> Decl::typemaybe() const {
     assert(false && "not all decl kinds handled");
 }
 
+void StructDecl::build_field_index() {
+    field_index.clear();
+    field_index.reserve(fields.size());
+    for (size_t i = 0; i < fields.size(); i++) {
+        field_index.push_back({fields[i]->name, i});
+    }
+    // Sorting by (name, ordinal) keeps duplicates in declaration order.
+    std::sort(field_index.begin(), field_index.end());
+}
+
+VarDecl *StructDecl::find_field(const Name *name) const {
+    auto it = std::lower_bound(
+        field_index.begin(), field_index.end(), name,
+        [](const std::pair<Name *, size_t> &e, const Name *n) {
+            return std::less<const Name *>{}(e.first, n);
+        });
+    if (it == field_index.end() || it->first != name) {
+        return nullptr;
+    }
+    return fields[it->second];
+}
+
+template <typename T> static size_t vec_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+std::pair<const char *, size_t> ast_node_info(const AstNode *n) {
+    switch (n->kind) {
+    case AstKind::file:
+        return {"File", sizeof(File) + vec_bytes(n->as<File>()->toplevels)};
+    case AstKind::stmt:
+        switch (n->as<Stmt>()->kind) {
+        case StmtKind::decl:
+            return {"DeclStmt", sizeof(DeclStmt)};
+        case StmtKind::expr:
+            return {"ExprStmt", sizeof(ExprStmt)};
+        case StmtKind::assign:
+            return {"AssignStmt", sizeof(AssignStmt)};
+        case StmtKind::return_:
+            return {"ReturnStmt", sizeof(ReturnStmt)};
+        case StmtKind::compound:
+            return {"CompoundStmt", sizeof(CompoundStmt) +
+                                        vec_bytes(n->as<CompoundStmt>()->stmts)};
+        case StmtKind::if_:
+            return {"IfStmt", sizeof(IfStmt)};
+        case StmtKind::builtin:
+            return {"BuiltinStmt", sizeof(BuiltinStmt)};
+        case StmtKind::bad:
+            return {"BadStmt", sizeof(BadStmt)};
+        }
+        break;
+    case AstKind::expr:
+        switch (n->as<Expr>()->kind) {
+        case ExprKind::integer_literal:
+            return {"IntegerLiteral", sizeof(IntegerLiteral)};
+        case ExprKind::string_literal:
+            return {"StringLiteral", sizeof(StringLiteral)};
+        case ExprKind::decl_ref:
+            return {"DeclRefExpr", sizeof(DeclRefExpr)};
+        case ExprKind::call:
+            return {"CallExpr",
+                    sizeof(CallExpr) + vec_bytes(n->as<CallExpr>()->args)};
+        case ExprKind::struct_def:
+            return {"StructDefExpr", sizeof(StructDefExpr) +
+                                         vec_bytes(n->as<StructDefExpr>()->terms)};
+        case ExprKind::cast:
+            return {"CastExpr", sizeof(CastExpr)};
+        case ExprKind::member:
+            return {"MemberExpr", sizeof(MemberExpr)};
+        case ExprKind::unary:
+            return {"UnaryExpr", sizeof(UnaryExpr)};
+        case ExprKind::binary:
+            return {"BinaryExpr", sizeof(BinaryExpr)};
+        case ExprKind::type:
+            return {"TypeExpr", sizeof(TypeExpr)};
+        case ExprKind::bad:
+            return {"BadExpr", sizeof(BadExpr)};
+        }
+        break;
+    case AstKind::decl:
+        switch (n->as<Decl>()->kind) {
+        case DeclKind::var:
+            return {"VarDecl",
+                    sizeof(VarDecl) + vec_bytes(n->as<VarDecl>()->children)};
+        case DeclKind::func:
+            return {"FuncDecl",
+                    sizeof(FuncDecl) + vec_bytes(n->as<FuncDecl>()->args)};
+        case DeclKind::struct_:
+            return {"StructDecl",
+                    sizeof(StructDecl) +
+                        vec_bytes(n->as<StructDecl>()->fields) +
+                        vec_bytes(n->as<StructDecl>()->field_index)};
+        case DeclKind::enum_variant:
+            return {"EnumVariantDecl",
+                    sizeof(EnumVariantDecl) +
+                        vec_bytes(n->as<EnumVariantDecl>()->fields)};
+        case DeclKind::enum_:
+            return {"EnumDecl",
+                    sizeof(EnumDecl) + vec_bytes(n->as<EnumDecl>()->variants)};
+        case DeclKind::extern_:
+            return {"ExternDecl", sizeof(ExternDecl)};
+        case DeclKind::bad:
+            return {"BadDecl", sizeof(BadDecl)};
+        }
+        break;
+    }
+    assert(false && "not all node kinds handled");
+    return {"", 0};
+}
+
 } // namespace cmp
@@ -24,6 +24,11 @@ class Lifetime;
 
 std::pair<size_t, size_t> get_ast_range(std::initializer_list<AstNode *> nodes);
 
+// Name of the concrete node type and the number of bytes it occupies,
+// including the heap storage of its member vectors.  Used for memory
+// statistics.
+std::pair<const char *, size_t> ast_node_info(const AstNode *n);
+
 enum class AstKind {
     file,
     stmt,
@@ -292,7 +297,8 @@ struct BinaryExpr : public Expr {
 
 struct TypeExpr : public Expr {
     TypeKind kind = TypeKind::value;
-    // Name of the type. TODO: should this contain '&' and '[]'?
+    // Name of the type.  Null for derived types, which are identified by
+    // 'kind' and 'subexpr' instead.
     Name *name = nullptr;
     // Expr's 'decl' is the Decl object that represents this type.
 
@@ -444,6 +450,12 @@ struct FuncDecl : public Decl {
     // "Bogus" lifetime that represents the scope of the function body.
     Lifetime *scope_lifetime = nullptr;
 
+    // Whether the body has been typechecked.  In demand-driven mode, bodies
+    // of functions that are never called are left unchecked.
+    bool body_checked = false;
+    // Whether the body has been scheduled for checking in demand-driven mode.
+    bool body_queued = false;
+
     FuncDecl(Name *n) : Decl(DeclKind::func, n) {}
     size_t args_count() const { return args.size(); }
 };
@@ -452,8 +464,18 @@ struct FuncDecl : public Decl {
 struct StructDecl : public Decl {
     std::vector<VarDecl *> fields; // member variables
 
+    // (name, ordinal) of each field sorted by name, so that a field can be
+    // found by binary search instead of scanning 'fields'.  Built by
+    // build_field_index() when the struct is typechecked.
+    std::vector<std::pair<Name *, size_t>> field_index;
+
     StructDecl(Name *n, std::vector<VarDecl *> m)
         : Decl(DeclKind::struct_, n), fields(m) {}
+
+    void build_field_index();
+    // Return the field named `name`, or nullptr if there is none.  Of
+    // duplicate fields, the one declared first is returned.
+    VarDecl *find_field(const Name *name) const;
 };
 
 // A variant type in an enum.
@@ -0,0 +1,248 @@
+// Micro-benchmarks for the compiler data structures.
+//
+// Usage: ruse-bench [name...]
+// Runs every benchmark if no name is given.
+
+#include "concurrent_name_table.h"
+#include "fmt/core.h"
+#include "scoped_table.h"
+#include "shadow_table.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <thread>
+
+using namespace cmp;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Stream of identifier occurrences with heavy reuse, laid out like source text
+// so that the interners see the same kind of (pointer, length) input as the
+// lexer gives them.
+struct IdentCorpus {
+    std::string text;
+    std::vector<std::pair<size_t, size_t>> idents; // (offset, length)
+
+    IdentCorpus(size_t distinct, size_t occurrences) {
+        std::vector<std::string> pool;
+        std::mt19937_64 rng{42};
+        for (size_t i = 0; i < distinct; i++) {
+            pool.push_back(fmt::format("ident_{}_{}", i, rng() % 1000));
+        }
+        // Skew the distribution towards a small set of hot identifiers, the
+        // way locals and common type names dominate real code.
+        std::uniform_real_distribution<double> u{0.0, 1.0};
+        for (size_t i = 0; i < occurrences; i++) {
+            double x = u(rng);
+            auto &s = pool[static_cast<size_t>(x * x * x * distinct)];
+            idents.push_back({text.size(), s.size()});
+            text += s;
+            text += ' ';
+        }
+    }
+};
+
+// Run `fn(begin, end)` over `n` items split evenly across `threads` threads,
+// and return the wall time.
+double run_threads(unsigned threads, size_t n,
+                   const std::function<void(size_t, size_t)> &fn) {
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back(fn, n * t / threads, n * (t + 1) / threads);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    return seconds_since(start);
+}
+
+void bench_intern() {
+    IdentCorpus corpus{50000, 4000000};
+    const size_t n = corpus.idents.size();
+    unsigned max_threads = std::max(8u, std::thread::hardware_concurrency());
+
+    fmt::print("intern: {} occurrences of {} identifiers\n", n, 50000);
+    fmt::print("{:>8} {:>20} {:>20}\n", "threads", "mutex+NameTable M/s",
+               "ConcurrentNameTable M/s");
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        NameTable locked_table;
+        std::mutex mutex;
+        double locked = run_threads(threads, n, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; i++) {
+                auto [off, len] = corpus.idents[i];
+                std::lock_guard<std::mutex> lock{mutex};
+                locked_table.pushlen(corpus.text.data() + off, len);
+            }
+        });
+
+        ConcurrentNameTable sharded_table;
+        double sharded = run_threads(threads, n, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; i++) {
+                auto [off, len] = corpus.idents[i];
+                sharded_table.pushlen(corpus.text.data() + off, len);
+            }
+        });
+
+        if (sharded_table.size() != locked_table.size()) {
+            fmt::print(stderr, "intern: table sizes differ ({} vs {})\n",
+                       sharded_table.size(), locked_table.size());
+            exit(EXIT_FAILURE);
+        }
+        fmt::print("{:>8} {:>20.1f} {:>20.1f}\n", threads, n / locked / 1e6,
+                   n / sharded / 1e6);
+    }
+}
+
+// Make `n` distinct Names.
+std::vector<Name *> make_names(NameTable &names, size_t n) {
+    std::vector<Name *> v;
+    for (size_t i = 0; i < n; i++) {
+        auto s = fmt::format("sym_{}", i);
+        v.push_back(names.pushlen(s.data(), s.size()));
+    }
+    return v;
+}
+
+// Random lookup pattern over `n` keys, shared by the symbol table benchmarks.
+std::vector<size_t> make_lookups(size_t n, size_t count) {
+    std::mt19937_64 rng{7};
+    std::vector<size_t> v(count);
+    for (auto &i : v) {
+        i = rng() % n;
+    }
+    return v;
+}
+
+void bench_lookup() {
+    constexpr size_t lookup_count = 2000000;
+    fmt::print("lookup: {} random finds over N global symbols\n", lookup_count);
+    fmt::print("{:>10} {:>12} {:>12} {:>10}\n", "N", "insert ns", "find ns",
+               "buckets");
+    for (size_t n = 100; n <= 1000000; n *= 10) {
+        NameTable names;
+        auto keys = make_names(names, n);
+        auto lookups = make_lookups(n, lookup_count);
+
+        ScopedTable<Name *, Name *> table;
+        auto start = Clock::now();
+        for (auto k : keys) {
+            table.insert(k, k);
+        }
+        double insert = seconds_since(start);
+
+        size_t found = 0;
+        start = Clock::now();
+        for (auto i : lookups) {
+            found += table.find(keys[i])->value == keys[i];
+        }
+        double find = seconds_since(start);
+        if (found != lookup_count) {
+            fmt::print(stderr, "lookup: wrong symbol found\n");
+            exit(EXIT_FAILURE);
+        }
+
+        fmt::print("{:>10} {:>12.1f} {:>12.1f} {:>10}\n", n, insert / n * 1e9,
+                   find / lookup_count * 1e9, table.keys.size());
+    }
+}
+
+// Decl-table-like workload: many globals, then a series of function bodies
+// that each open a scope, declare a few locals (often reusing the same names,
+// and thus shadowing globals of the same name), resolve identifiers and close
+// the scope.  Returns ns per lookup.
+template <typename Table>
+double run_scopes(const std::vector<Name *> &globals,
+                  const std::vector<Name *> &locals,
+                  const std::vector<size_t> &lookups) {
+    constexpr size_t funcs = 20000;
+    constexpr size_t locals_per_func = 8;
+    constexpr size_t lookups_per_func = 64;
+
+    Table table;
+    for (auto g : globals) {
+        table.insert(g, g);
+    }
+
+    size_t found = 0, li = 0;
+    auto start = Clock::now();
+    for (size_t f = 0; f < funcs; f++) {
+        table.scope_open();
+        for (size_t i = 0; i < locals_per_func; i++) {
+            auto l = locals[(f + i * 31) % locals.size()];
+            table.insert(l, l);
+        }
+        for (size_t i = 0; i < lookups_per_func; i++) {
+            size_t r = lookups[li++ % lookups.size()];
+            // Roughly two thirds of the references are to locals.
+            Name *key = (r % 3) ? locals[(f + (r % locals_per_func) * 31) %
+                                         locals.size()]
+                                : globals[r % globals.size()];
+            auto sym = table.find(key);
+            found += sym && sym->value == key;
+        }
+        table.scope_close();
+    }
+    double t = seconds_since(start);
+    if (found != funcs * lookups_per_func) {
+        fmt::print(stderr, "scopes: wrong symbol found\n");
+        exit(EXIT_FAILURE);
+    }
+    return t / (funcs * lookups_per_func) * 1e9;
+}
+
+void bench_scopes() {
+    fmt::print("scopes: ScopedTable (hash) vs ShadowTable (per-Name stack)\n");
+    fmt::print("{:>10} {:>14} {:>14}\n", "globals", "hash ns", "shadow ns");
+    for (size_t n = 100; n <= 1000000; n *= 10) {
+        NameTable names;
+        auto globals = make_names(names, n);
+        // Locals reuse a small vocabulary, part of which collides with
+        // global names.
+        std::vector<Name *> locals{globals.begin(),
+                                   globals.begin() + std::min<size_t>(n, 16)};
+        for (size_t i = 0; i < 200; i++) {
+            auto s = fmt::format("local_{}", i);
+            locals.push_back(names.pushlen(s.data(), s.size()));
+        }
+        auto lookups = make_lookups(1 << 30, 1 << 20);
+
+        double hash = run_scopes<ScopedTable<Name *, Name *>>(globals, locals,
+                                                              lookups);
+        double shadow = run_scopes<ShadowTable<Name *>>(globals, locals, lookups);
+        fmt::print("{:>10} {:>14.1f} {:>14.1f}\n", n, hash, shadow);
+    }
+}
+
+struct Benchmark {
+    const char *name;
+    void (*fn)();
+};
+
+constexpr Benchmark benchmarks[]{
+    {"intern", bench_intern},
+    {"lookup", bench_lookup},
+    {"scopes", bench_scopes},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for (auto &b : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            selected |= strcmp(argv[i], b.name) == 0;
+        }
+        if (selected) {
+            b.fn();
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef CMP_CONCURRENT_NAME_TABLE_H
+#define CMP_CONCURRENT_NAME_TABLE_H
+
+#include "types.h"
+#include <array>
+#include <atomic>
+#include <mutex>
+
+namespace cmp {
+
+// Thread-safe variant of NameTable, for front-end passes that intern
+// identifiers from more than one thread.
+//
+// The table is split into lock-striped shards, each of which is an ordinary
+// NameTable.  A string always hashes to the same shard, so there is still only
+// one Name per string and Names can be compared by pointer regardless of the
+// thread that interned them.  Each thread additionally keeps a small
+// direct-mapped cache of its recent lookups, which lets the common case of a
+// repeated identifier return without taking any lock.
+class ConcurrentNameTable {
+public:
+    static constexpr size_t SHARD_COUNT = 64;
+
+    ConcurrentNameTable();
+    ConcurrentNameTable(const ConcurrentNameTable &) = delete;
+    ConcurrentNameTable &operator=(const ConcurrentNameTable &) = delete;
+
+    Name *push(const char *s) { return pushlen(s, strlen(s)); }
+    Name *pushlen(const char *s, size_t len);
+    Name *get(std::string_view sv) const;
+
+    // Number of interned names.  Only exact when no thread is inserting.
+    size_t size() const;
+
+private:
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        NameTable table;
+    };
+
+    // Shards are selected by the top bits of the hash, since the low bits
+    // index the slots inside each shard.
+    const Shard &shard_of(uint64_t h) const { return shards[h >> 58]; }
+    Shard &shard_of(uint64_t h) { return shards[h >> 58]; }
+
+    std::array<Shard, SHARD_COUNT> shards;
+    // Source of Name ids across all shards.
+    std::atomic<uint32_t> next_name_id{0};
+    // Unique for the lifetime of the process, so that entries that a
+    // thread-local cache holds for a destroyed table never match a new one.
+    const uint64_t id;
+};
+
+} // namespace cmp
+
+#endif
@@ -0,0 +1,149 @@
+#include "diagnostic.h"
+#include "alloc_profile.h"
+#include "types.h"
+#include "fmt/core.h"
+#include <algorithm>
+
+namespace cmp {
+
+namespace {
+
+const char *const diag_names[] = {
+#define X(id, format) #id,
+    RUSE_DIAGNOSTICS(X)
+#undef X
+};
+
+const char *const diag_formats[] = {
+#define X(id, format) format,
+    RUSE_DIAGNOSTICS(X)
+#undef X
+};
+
+bool same_args(const Diagnostic &a, const Diagnostic &b) {
+    for (size_t i = 0; i < MAX_DIAG_ARGS; i++) {
+        if (a.args[i].kind != b.args[i].kind ||
+            a.args[i].format() != b.args[i].format()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string json_escape(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += fmt::format("\\u{:04x}", c);
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+std::string DiagArg::format() const {
+    switch (kind) {
+    case none:
+        return {};
+    case text:
+        return str;
+    case type:
+        return ty->str();
+    case number:
+        return std::to_string(num);
+    }
+    return {};
+}
+
+const char *Diagnostic::name() const {
+    return diag_names[static_cast<size_t>(id)];
+}
+
+std::string Diagnostic::message() const {
+    ALLOC_SCOPE(fmt);
+    // Surplus arguments are ignored by fmt.
+    return fmt::format(diag_formats[static_cast<size_t>(id)], args[0].format(),
+                       args[1].format(), args[2].format());
+}
+
+void Diagnostics::sort() {
+    // Stable, so that diagnostics at the same position keep the order they
+    // were found in.
+    std::stable_sort(list.begin(), list.end(),
+                     [](const Diagnostic &a, const Diagnostic &b) {
+                         return a.pos < b.pos;
+                     });
+    list.erase(std::unique(list.begin(), list.end(),
+                           [](const Diagnostic &a, const Diagnostic &b) {
+                               return a.id == b.id && a.pos == b.pos &&
+                                      same_args(a, b);
+                           }),
+               list.end());
+}
+
+void Diagnostics::save_args() {
+    for (auto &d : list) {
+        for (auto &arg : d.args) {
+            if (arg.kind == DiagArg::text || arg.kind == DiagArg::type) {
+                saved.push_back(arg.format());
+                arg = DiagArg{saved.back().c_str()};
+            }
+        }
+    }
+}
+
+void Diagnostics::emit(const Source &source, FILE *out) {
+    sort();
+
+    size_t count = list.size();
+    if (opts.error_limit && count > opts.error_limit) {
+        count = opts.error_limit;
+    }
+
+    if (opts.json) {
+        fmt::print(out, "[");
+        for (size_t i = 0; i < count; i++) {
+            auto &d = list[i];
+            auto loc = source.locate(d.pos);
+            fmt::print(out,
+                       "{}\n  {{\"file\": \"{}\", \"line\": {}, \"column\": {}, "
+                       "\"severity\": \"error\", \"id\": \"{}\", "
+                       "\"message\": \"{}\"}}",
+                       i == 0 ? "" : ",", json_escape(loc.filename), loc.line,
+                       loc.col, d.name(), json_escape(d.message()));
+        }
+        fmt::print(out, "{}]\n", count == 0 ? "" : "\n");
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        auto loc = source.locate(list[i].pos);
+        fmt::print(out, "{}:{}:{}: error: {}\n", loc.filename, loc.line,
+                   loc.col, list[i].message());
+    }
+    if (count < list.size()) {
+        fmt::print(out, "error: too many errors, {} more not shown "
+                        "(-ferror-limit={})\n",
+                   list.size() - count, opts.error_limit);
+    }
+}
+
+} // namespace cmp
@@ -0,0 +1,122 @@
+#ifndef CMP_DIAGNOSTIC_H
+#define CMP_DIAGNOSTIC_H
+
+#include "source.h"
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace cmp {
+
+struct Type;
+
+// All diagnostics that the compiler can report, as X(id, format).  The format
+// is only applied when the diagnostic is emitted.
+#define RUSE_DIAGNOSTICS(X)                                                    \
+    /* Parser */                                                               \
+    X(expected, "expected {}, found '{}'")                                     \
+    X(expected_token, "expected '{}', found '{}'")                             \
+    X(expected_assign, "expected '=' or '\\n' after expression")              \
+    X(unterminated_struct, "unterminated struct declaration")                  \
+    X(unterminated_enum, "unterminated enum declaration")                      \
+    X(trailing_token, "trailing token '{}' after declaration")                 \
+    X(qualified_struct_name, "qualified struct names are not yet supported")   \
+    X(unexpected_toplevel, "unexpected '{}' at toplevel")                      \
+    /* Sema */                                                                 \
+    X(redefinition, "redefinition of '{}'")                                    \
+    X(undeclared_identifier, "undeclared identifier '{}'")                     \
+    X(undeclared_function, "undeclared function '{}'")                         \
+    X(undefined_type, "undefined type '{}'")                                   \
+    X(not_a_function, "'{}' is not a function")                                \
+    X(argument_count, "'{}' accepts {} arguments, got {}")                     \
+    X(argument_type, "argument type mismatch: expects '{}', got '{}'")         \
+    X(deref_non_pointer, "dereferenced a non-pointer type '{}'")               \
+    X(address_of_rvalue, "cannot take address of an rvalue")                   \
+    X(not_a_struct, "type '{}' is not a struct")                               \
+    X(unknown_field, "unknown field '{}' in struct '{}'")                      \
+    X(assign_type, "cannot assign '{}' type to '{}'")                          \
+    X(binary_op_type, "incompatible binary op with type '{}' and '{}'")        \
+    X(not_implemented, "internal: typecheck not implemented")
+
+enum class Diag : uint16_t {
+#define X(id, format) id,
+    RUSE_DIAGNOSTICS(X)
+#undef X
+};
+
+// An argument of a diagnostic, kept unformatted.  Text must outlive the
+// diagnostic until it is emitted; Names and the text of the source do.
+struct DiagArg {
+    enum Kind : uint8_t { none, text, type, number } kind = none;
+    union {
+        const char *str;
+        const Type *ty;
+        size_t num;
+    };
+
+    DiagArg() : num(0) {}
+    DiagArg(const char *s) : kind(text), str(s) {}
+    DiagArg(const Type *t) : kind(type), ty(t) {}
+    DiagArg(size_t n) : kind(number), num(n) {}
+
+    std::string format() const;
+};
+
+constexpr size_t MAX_DIAG_ARGS = 3;
+
+// A reported diagnostic: what, where in the source text, and with which
+// arguments.
+struct Diagnostic {
+    Diag id;
+    size_t pos;
+    DiagArg args[MAX_DIAG_ARGS];
+
+    // Identifier of the diagnostic, e.g. "unknown_field".
+    const char *name() const;
+    std::string message() const;
+};
+
+// How to emit diagnostics.
+struct DiagOptions {
+    // Emit at most this many errors, or all of them if 0.
+    size_t error_limit = 0;
+    // Emit a JSON array instead of text.
+    bool json = false;
+};
+
+// Diagnostics of a compilation.  They are recorded cheaply as they are found,
+// in any order and from any pass, and turned into text once at the end by
+// emit().
+class Diagnostics {
+public:
+    DiagOptions opts;
+    std::vector<Diagnostic> list;
+
+    template <typename... Args> void report(size_t pos, Diag id, Args... args) {
+        static_assert(sizeof...(Args) <= MAX_DIAG_ARGS,
+                      "too many diagnostic arguments");
+        list.push_back(Diagnostic{id, pos, {DiagArg{args}...}});
+    }
+
+    bool empty() const { return list.empty(); }
+    size_t size() const { return list.size(); }
+
+    // Sort the diagnostics by position and drop duplicates.
+    void sort();
+    // sort() and print the diagnostics to `out`.
+    void emit(const Source &source, FILE *out = stderr);
+    // Copy the text of all arguments into the diagnostics themselves, so that
+    // they can still be formatted after the types and names they refer to are
+    // gone.
+    void save_args();
+
+private:
+    // Text of the saved arguments.  A deque, so that it never moves.
+    std::deque<std::string> saved;
+};
+
+} // namespace cmp
+
+#endif
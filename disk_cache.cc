@@ -0,0 +1,175 @@
+#include "disk_cache.h"
+#include "fmt/core.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <elf.h>
+#include <link.h>
+#endif
+
+namespace cmp {
+
+#ifdef __linux__
+// Copy the GNU build ID note of the executable, which the linker computes by
+// hashing its contents, into `data`.
+static int find_build_id(struct dl_phdr_info *info, size_t, void *data) {
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        auto &ph = info->dlpi_phdr[i];
+        if (ph.p_type != PT_NOTE) {
+            continue;
+        }
+        auto p = reinterpret_cast<const char *>(info->dlpi_addr + ph.p_vaddr);
+        auto end = p + ph.p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            auto note = reinterpret_cast<const ElfW(Nhdr) *>(p);
+            auto name = p + sizeof(*note);
+            auto desc = name + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0) {
+                static_cast<std::string *>(data)->assign(desc, note->n_descsz);
+                break;
+            }
+            p = desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+    // The executable comes first; the shared libraries do not matter.
+    return 1;
+}
+#endif
+
+// Identity of this build of the compiler: its build ID, or failing that, a
+// hash of the executable file.
+static const std::string &build_id() {
+    static const std::string id = [] {
+        std::string id;
+#ifdef __linux__
+        dl_iterate_phdr(find_build_id, &id);
+        if (id.empty()) {
+            std::string exe;
+            if (read_file("/proc/self/exe", exe)) {
+                uint64_t h = UINT64_C(0xcbf29ce484222325);
+                for (unsigned char c : exe) {
+                    h ^= c;
+                    h *= UINT64_C(0x100000001b3);
+                }
+                id = fmt::format("{:016x}", h);
+            }
+        }
+#endif
+        if (id.empty()) {
+            id = __DATE__ " " __TIME__;
+        }
+        return id;
+    }();
+    return id;
+}
+
+// 128-bit FNV-1a, continued across calls.
+CacheKey::CacheKey()
+    : hash{Hash{UINT64_C(0x6c62272e07bb0142)} << 64 |
+           UINT64_C(0x62b821756295c58d)} {
+    add(build_id());
+}
+
+CacheKey &CacheKey::add(std::string_view sv) {
+    auto mix = [this](unsigned char c) {
+        hash ^= c;
+        // The prime is 2^88 + 0x13b.
+        hash = (hash << 88) + hash * 0x13b;
+    };
+    for (char c : sv) {
+        mix(c);
+    }
+    for (size_t len = sv.size(), i = 0; i < sizeof(len); i++) {
+        mix(len >> (i * 8));
+    }
+    return *this;
+}
+
+std::string DiskCache::default_dir() {
+    if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return std::string{xdg} + "/ruse";
+    }
+    if (auto home = getenv("HOME"); home && *home) {
+        return std::string{home} + "/.cache/ruse";
+    }
+    return ".ruse-cache";
+}
+
+// mkdir -p.
+static bool make_dirs(const std::string &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i < path.size() && path[i] != '/') {
+            continue;
+        }
+        auto prefix = path.substr(0, i);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string DiskCache::entry_path(CacheKey key, const char *kind) const {
+    auto hex = fmt::format("{:016x}{:016x}",
+                           static_cast<uint64_t>(key.hash >> 64),
+                           static_cast<uint64_t>(key.hash));
+    // Fan out over subdirectories so that no directory gets too large.
+    return fmt::format("{}/{}/{}-{}", dir, hex.substr(0, 2), hex.substr(2), kind);
+}
+
+bool DiskCache::get(CacheKey key, const char *kind, std::string &out) const {
+    return read_file(entry_path(key, kind), out);
+}
+
+void DiskCache::put(CacheKey key, const char *kind, std::string_view data) const {
+    auto path = entry_path(key, kind);
+    if (!make_dirs(path.substr(0, path.rfind('/')))) {
+        return;
+    }
+    // Write to a private file first and rename it into place, so that other
+    // compilers, and other threads of this one, never see a partially written
+    // entry.
+    auto tmp = path + ".tmpXXXXXX";
+    int fd = mkstemp(tmp.data());
+    if (fd < 0) {
+        return;
+    }
+    bool ok = fchmod(fd, 0644) == 0;
+    for (size_t done = 0; ok && done < data.size();) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno != EINTR) {
+            ok = false;
+        }
+        done += n > 0 ? n : 0;
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
+
+bool read_file(const std::string &path, std::string &out) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in) {
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+bool write_file(const std::string &path, std::string_view data) {
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    out.write(data.data(), data.size());
+    return static_cast<bool>(out);
+}
+
+} // namespace cmp
@@ -0,0 +1,60 @@
+#ifndef CMP_DISK_CACHE_H
+#define CMP_DISK_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace cmp {
+
+// Key of a cache entry, computed by hashing everything that the cached output
+// depends on.  Every key starts with the identity of the compiler build, so
+// that the entries of other builds are never reused.  Hits are not checked
+// against the inputs, so the hash is 128 bits wide to make collisions
+// practically impossible.
+struct CacheKey {
+    __extension__ typedef unsigned __int128 Hash;
+    Hash hash;
+
+    CacheKey();
+    // Mix in `sv`.  The length goes in as well, so that ("ab", "c") and ("a",
+    // "bc") give different keys.
+    CacheKey &add(std::string_view sv);
+};
+
+// Content-addressed store of compiler outputs, shared by all invocations of
+// the compiler.  Entries are files named by their key and kind, e.g.
+// "<dir>/3f/a0c1...-qbe", and are never modified after they are written, so
+// concurrent compilers can share a directory without locking.
+struct DiskCache {
+    std::string dir;
+
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+    // Whole compilations, functions and QBE-to-assembly steps.
+    Stats modules, funcs, assembly;
+
+    DiskCache(const std::string &dir) : dir{dir} {}
+
+    // $XDG_CACHE_HOME/ruse, or ~/.cache/ruse.
+    static std::string default_dir();
+
+    // Read the entry for `key` into `out`.  Return false if there is none.
+    bool get(CacheKey key, const char *kind, std::string &out) const;
+    // Store `data` for `key`.  Failing to store is not an error; the entry is
+    // simply missing the next time.
+    void put(CacheKey key, const char *kind, std::string_view data) const;
+
+private:
+    std::string entry_path(CacheKey key, const char *kind) const;
+};
+
+// Helpers for moving compiler outputs in and out of the cache.
+bool read_file(const std::string &path, std::string &out);
+bool write_file(const std::string &path, std::string_view data);
+
+} // namespace cmp
+
+#endif
@@ -1,26 +1,485 @@
 #include "driver.h"
 #include "ast.h"
+#include "disk_cache.h"
 #include "parser.h"
 #include "sema.h"
+#include "trace.h"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+
+template <typename Table>
+void print_table_stats(const char *name, const Table &table) {
+    using Symbol = typename Table::Symbol;
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", name, table.peak_count,
+               table.peak_count * sizeof(Symbol));
+}
+
+template <typename T>
+void print_pool_stats(const char *name, const SlabPool<T> &pool) {
+    fmt::print(stderr, "  {:<16} {:>10} {:>10} {:>12}\n", name, pool.size(),
+               pool.peak_size(), pool.capacity_bytes());
+}
+
+// Print the memory usage of the compiler data structures at the end of
+// `phase`.
+void mem_report(const char *phase, const Lexer &lexer, const Parser &parser,
+                const Sema &sema) {
+    fmt::print(stderr, "=== memory report after {} ===\n", phase);
+
+    // Sort by kind name so that the output is stable.
+    std::map<const char *, std::pair<size_t, size_t>,
+             bool (*)(const char *, const char *)>
+        nodes{[](const char *a, const char *b) { return strcmp(a, b) < 0; }};
+    size_t node_count = 0, node_bytes = 0, loc_bytes = 0;
+    for (auto &n : sema.node_pool) {
+        auto [kind, bytes] = ast_node_info(n.get());
+        nodes[kind].first++;
+        nodes[kind].second += bytes;
+        node_count++;
+        node_bytes += bytes;
+        // SourceLoc keeps its own copy of the filename, which spills to the
+        // heap unless it fits in the small string buffer.
+        for (auto *loc : {&n->loc, &n->endloc}) {
+            if (loc->filename.capacity() > std::string{}.capacity()) {
+                loc_bytes += loc->filename.capacity() + 1;
+            }
+        }
+    }
+    fmt::print(stderr, "AST nodes:\n");
+    for (auto &[kind, stat] : nodes) {
+        fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", kind, stat.first,
+                   stat.second);
+    }
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "total", node_count,
+               node_bytes);
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "SourceLoc heap", "",
+               loc_bytes);
+
+    fmt::print(stderr, "Tokens:\n");
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "token cache",
+               parser.token_cache.size(),
+               parser.token_cache.capacity() * sizeof(Token));
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "line offsets",
+               lexer.line_off.size(),
+               lexer.line_off.capacity() * sizeof(size_t));
+
+    fmt::print(stderr, "NameTable:\n");
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "entries",
+               sema.name_table.size(),
+               sema.name_table.size() * sizeof(Name) +
+                   sema.name_table.table_bytes());
+    fmt::print(stderr, "  {:<16} {:>10} {:>12}\n", "text", "",
+               sema.name_table.text_bytes());
+
+    fmt::print(stderr, "Symbol tables (peak live):\n");
+    print_table_stats("decl_table", sema.decl_table);
+    print_table_stats("type_table", sema.type_table);
+    print_table_stats("lifetime_table", sema.lifetime_table);
+    print_table_stats("borrow_table", sema.borrow_table);
+
+    fmt::print(stderr, "Pools (live, peak, reserved bytes):\n");
+    print_pool_stats("Type", sema.type_pool);
+    print_pool_stats("Lifetime", sema.lifetime_pool);
+    print_pool_stats("BasicBlock", sema.basic_block_pool);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fmt::print(stderr, "Peak RSS: {} KB\n", ru.ru_maxrss);
+}
+
+// Intermediate and final outputs of a compilation, as suffixes to the output
+// path, and the kinds under which they are cached.
+const std::pair<const char *, const char *> outputs[] = {
+    {".qbe", "qbe"},
+    {".s", "s"},
+    {"", "exe"},
+};
+
+// Identity of the external tool `name`, looked up in PATH if it has no slash,
+// for keying the outputs it makes: its path, size and modification time.  Empty
+// if it is not found, which gives a key that no installed tool shares.
+std::string tool_identity(const std::string &name) {
+    std::string path = name;
+    if (name.find('/') == std::string::npos) {
+        path.clear();
+        auto dirs = getenv("PATH");
+        for (std::string_view rest = dirs ? dirs : ""; path.empty();) {
+            auto colon = rest.find(':');
+            auto dir = rest.substr(0, colon);
+            auto candidate = fmt::format("{}/{}", dir.empty() ? "." : dir, name);
+            if (access(candidate.c_str(), X_OK) == 0) {
+                path = candidate;
+            }
+            if (colon == std::string_view::npos) {
+                break;
+            }
+            rest.remove_prefix(colon + 1);
+        }
+    }
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0) {
+        return {};
+    }
+    return fmt::format("{}:{}:{}.{}", path, st.st_size, st.st_mtim.tv_sec,
+                       st.st_mtim.tv_nsec);
+}
+
+// Key of the outputs of compiling `source` with `opts`.  Only the options that
+// change the generated code go in, along with the tools that build the
+// executable.
+CacheKey module_key(const Source &source, const Options &opts) {
+    CacheKey key;
+    key.add(opts.demand_driven ? "demand-driven" : "");
+    key.add(tool_identity(qbe_path()));
+    key.add(tool_identity("gcc"));
+    key.add({source.buf.data(), source.buf.size()});
+    return key;
+}
+
+// Restore all outputs of an earlier identical compilation.  Return false if
+// any of them is missing.
+bool restore_outputs(const DiskCache &disk, CacheKey key,
+                     const std::string &out) {
+    std::string data[std::size(outputs)];
+    for (size_t i = 0; i < std::size(outputs); i++) {
+        if (!disk.get(key, outputs[i].second, data[i])) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < std::size(outputs); i++) {
+        if (!write_file(out + outputs[i].first, data[i])) {
+            return false;
+        }
+    }
+    chmod(out.c_str(), 0755);
+    return true;
+}
+
+void store_outputs(const DiskCache &disk, CacheKey key,
+                   const std::string &out) {
+    std::string data[std::size(outputs)];
+    for (size_t i = 0; i < std::size(outputs); i++) {
+        if (!read_file(out + outputs[i].first, data[i])) {
+            return;
+        }
+    }
+    for (size_t i = 0; i < std::size(outputs); i++) {
+        disk.put(key, outputs[i].second, data[i]);
+    }
+}
+
+// Run the program `argv[0]`, looked up in PATH if it has no slash, and wait
+// for it.  Return true if it exits with 0.  The arguments are passed as they
+// are, without a shell, so paths need no quoting.
+bool run_tool(const std::vector<std::string> &argv) {
+    std::vector<char *> args;
+    for (auto &arg : argv) {
+        args.push_back(const_cast<char *>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], nullptr, nullptr, args.data(), environ);
+    if (err != 0) {
+        fmt::print(stderr, "error: {}: {}\n", argv[0], strerror(err));
+        return false;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Turn `out`.qbe, whose text is `qbe`, into `out`.s, reusing the assembly of an
+// earlier identical QBE file if there is one, made by the same qbe.
+bool assemble(DiskCache *disk, const std::string &out, std::string_view qbe) {
+    std::string s;
+    CacheKey key;
+    if (disk) {
+        key.add(tool_identity(qbe_path()));
+        key.add(qbe);
+        if (disk->get(key, "s", s) && write_file(out + ".s", s)) {
+            disk->assembly.hits++;
+            return true;
+        }
+        disk->assembly.misses++;
+    }
+    std::vector<std::string> cmd{qbe_path(), "-o", out + ".s", out + ".qbe"};
+    {
+        TRACE_SCOPE("tool", "qbe", cmd.back().c_str());
+        if (!run_tool(cmd)) {
+            return false;
+        }
+    }
+    if (disk && read_file(out + ".s", s)) {
+        disk->put(key, "s", s);
+    }
+    return true;
+}
+
+void cache_report(const DiskCache &disk) {
+    auto print = [](const char *name, const DiskCache::Stats &stats) {
+        fmt::print(stderr, "  {:<16} {:>10} {:>10}\n", name, stats.hits,
+                   stats.misses);
+    };
+    fmt::print(stderr, "=== cache report ({}) ===\n", disk.dir);
+    fmt::print(stderr, "  {:<16} {:>10} {:>10}\n", "", "hits", "misses");
+    print("module", disk.modules);
+    print("function", disk.funcs);
+    print("assembly", disk.assembly);
+}
+
+// Match an error message against the text of a beacon, where ".*" matches any
+// text.
+bool beacon_match(std::string_view pattern, std::string_view msg) {
+    auto star = pattern.find(".*");
+    if (star == std::string_view::npos) {
+        return pattern == msg;
+    }
+    if (msg.substr(0, star) != pattern.substr(0, star)) {
+        return false;
+    }
+    // Try the rest of the pattern at every position; beacons are short.
+    pattern.remove_prefix(star + 2);
+    for (size_t k = star; k <= msg.size(); k++) {
+        if (beacon_match(pattern, msg.substr(k))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+std::string qbe_path() {
+    auto home = getenv("HOME");
+    return std::string{home ? home : ""} + "/build/qbe/bin/qbe";
+}
 
 bool Driver::compile() {
+    TRACE_SCOPE("compile", "compile", source.filename.c_str());
+    if (!opts.time_report) {
+        return run_phases(nullptr);
+    }
+    TimeReport timing{opts.time_report};
+    PerfCounters counters;
+    if (opts.perf_counters) {
+        std::string why;
+        if (counters.open(why)) {
+            timing.counters = &counters;
+        } else {
+            fmt::print(stderr,
+                       "note: hardware counters are not available ({}), "
+                       "reporting timings only\n",
+                       why);
+        }
+    }
+    bool success = run_phases(&timing);
+    timing.print(source.filename);
+    return success;
+}
+
+bool Driver::run_phases(TimeReport *timing) {
+    std::unique_ptr<DiskCache> disk;
+    CacheKey key;
+    // A cache hit would skip lexing, and with it the beacons to verify.
+    if (!opts.cache_dir.empty() && !opts.verify) {
+        disk = std::make_unique<DiskCache>(opts.cache_dir);
+        // Only successful compilations are stored, so a hit means there is
+        // nothing to report either.
+        key = module_key(source, opts);
+        bool hit;
+        {
+            PhaseTimer t{timing, "cache lookup"};
+            hit = restore_outputs(*disk, key, opts.output);
+        }
+        if (hit) {
+            report();
+            disk->modules.hits++;
+            if (opts.verbose) {
+                cache_report(*disk);
+            }
+            return true;
+        }
+        disk->modules.misses++;
+    }
+
+    diags.opts = opts.diag;
     Lexer lexer{source};
-    Sema sema{source, errors, beacons};
+    lexer.beacons = &beacons;
+    Sema sema{source, diags, beacons, prelude, arena};
     Parser parser{lexer, sema};
 
-    auto node = parser.parse();
+    AstNode *node;
+    {
+        PhaseTimer t{timing, "parse"};
+        node = parser.parse();
+    }
+    if (opts.mem_report) {
+        mem_report("parse", lexer, parser, sema);
+    }
     if (!no_errors()) {
+        // Parsing stopped early; collect the beacons in the rest of the file.
+        while (lexer.lex().kind != Tok::eos) {
+        }
+        if (!opts.verify) {
+            report();
+        }
+        diags.save_args();
         return false;
     }
 
-    setup_builtin_types(sema);
-    typecheck(sema, node);
-    QbeGenerator c{sema, "out.qbe"};
-    codegen(c, node);
-    fflush(c.file);
+    {
+        PhaseTimer t{timing, "builtins"};
+        setup_builtin_types(sema);
+    }
+    sema.demand_driven = opts.demand_driven;
+    sema.cache = cache;
+    sema.time_report = timing;
+    if (cache) {
+        cache->stats = {};
+    }
+    {
+        PhaseTimer t{timing, "typecheck"};
+        typecheck(sema, node, opts.jobs);
+    }
+    if (opts.mem_report) {
+        mem_report("typecheck", lexer, parser, sema);
+    }
+    if (!opts.verify) {
+        report();
+    }
+    // Sema goes away on return, but the diagnostics may still be verified.
+    diags.save_args();
+    if (opts.verify || !no_errors()) {
+        return no_errors();
+    }
+    QbeGenerator c{sema};
+    c.disk_cache = disk.get();
+    bool written;
+    {
+        // Includes writing out the file.
+        PhaseTimer t{timing, "codegen"};
+        codegen(c, node);
+        written = write_file(opts.output + ".qbe", c.text());
+    }
+    if (!written) {
+        fmt::print(stderr, "error: {}.qbe: {}\n", opts.output,
+                   strerror(errno));
+        return false;
+    }
+    if (opts.mem_report) {
+        mem_report("codegen", lexer, parser, sema);
+    }
 
-    system("$HOME/build/qbe/bin/qbe -o out.s out.qbe");
-    system("gcc -o out out.s");
+    // Failures of the external tools are reported by themselves, and do not
+    // fail the compilation; they only keep the outputs out of the cache.
+    bool built;
+    {
+        PhaseTimer t{timing, "qbe"};
+        built = assemble(disk.get(), opts.output, c.text());
+    }
+    if (built) {
+        PhaseTimer t{timing, "gcc"};
+        std::vector<std::string> link{"gcc", "-o", opts.output,
+                                      opts.output + ".s"};
+        TRACE_SCOPE("tool", "gcc", link.back().c_str());
+        built = run_tool(link);
+    }
+    if (built && disk) {
+        store_outputs(*disk, key, opts.output);
+    }
+    if (disk && opts.verbose) {
+        cache_report(*disk);
+    }
 
     return true;
 }
+
+void Driver::report() { diags.emit(source); }
+
+bool Driver::verify() {
+    diags.sort();
+
+    // Both lists are in source order, so they can be matched up line by line
+    // in a single pass.
+    bool success = true;
+    size_t i = 0, j = 0;
+    while (i < diags.size() || j < beacons.size()) {
+        int line = i < diags.size() ? source.locate(diags.list[i].pos).line
+                                    : INT_MAX;
+        int beacon_line = j < beacons.size() ? beacons[j].loc.line : INT_MAX;
+        if (line == beacon_line) {
+            auto msg = diags.list[i].message();
+            // A beacon may leave out the details after a colon, e.g.
+            // "argument type mismatch".
+            auto brief = std::string_view{msg}.substr(0, msg.find(':'));
+            if (!beacon_match(beacons[j].message, msg) &&
+                !beacon_match(beacons[j].message, brief)) {
+                success = false;
+                fmt::print(stderr, "{}:{}: expected: {}\n", source.filename,
+                           beacon_line, beacons[j].message);
+                fmt::print(stderr, "{}:{}: got:      {}\n", source.filename,
+                           line, msg);
+            }
+            i++;
+            j++;
+        } else if (line < beacon_line) {
+            success = false;
+            fmt::print(stderr, "{}:{}: got:      {}\n", source.filename, line,
+                       diags.list[i].message());
+            i++;
+        } else {
+            success = false;
+            fmt::print(stderr, "{}:{}: expected: {}\n", source.filename,
+                       beacon_line, beacons[j].message);
+            j++;
+        }
+    }
+    return success;
+}
+
+void watch(const Path &path, const Options &opts) {
+    QueryCache cache;
+    struct timespec last_mtime {};
+
+    while (true) {
+        struct stat st;
+        // The file may briefly be missing while an editor saves it.
+        if (stat(path.path.c_str(), &st) == 0 &&
+            (st.st_mtim.tv_sec != last_mtime.tv_sec ||
+             st.st_mtim.tv_nsec != last_mtime.tv_nsec)) {
+            last_mtime = st.st_mtim;
+
+            auto start = std::chrono::steady_clock::now();
+            Driver d{path, opts};
+            d.cache = &cache;
+            bool ok = d.compile();
+            auto ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+            auto &stats = cache.stats;
+            fmt::print(stderr,
+                       "[watch] {} in {:.1f} ms: checked {} of {} bodies, "
+                       "generated {} of {} functions\n",
+                       ok ? "compiled" : "failed", ms, stats.body_misses,
+                       stats.body_hits + stats.body_misses, stats.qbe_misses,
+                       stats.qbe_hits + stats.qbe_misses);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
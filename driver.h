@@ -3,26 +3,89 @@
 #define CMP_DRIVER_H
 
 #include "source.h"
+#include "diagnostic.h"
 #include "error.h"
+#include "query.h"
+#include "time_report.h"
+
+namespace cmp {
+struct Prelude;
+struct SemaArena;
+}
 
 using namespace cmp;
 
+// Command line options that affect a compilation.
+struct Options {
+  // Print memory usage of the compiler data structures after each phase.
+  bool mem_report = false;
+  // Number of threads to typecheck function bodies with.
+  unsigned jobs = 1;
+  // Only typecheck and generate the functions reachable from main.
+  bool demand_driven = false;
+  // Recompile whenever the input file changes.
+  bool watch = false;
+  // Directory of the on-disk compilation cache, or empty to not use one.
+  std::string cache_dir;
+  // Print statistics such as cache hits and misses.
+  bool verbose = false;
+  // Path of the executable.  The QBE and assembly files go next to it, with
+  // .qbe and .s appended.
+  std::string output = "out";
+  // How to emit diagnostics.
+  DiagOptions diag;
+  // Check the diagnostics against the error beacons in the source instead of
+  // printing them, and stop before code generation.
+  bool verify = false;
+  // Print the time taken by each phase and by this many of the slowest
+  // functions, or nothing if 0.
+  size_t time_report = 0;
+  // Add hardware performance counters to the time report.
+  bool perf_counters = false;
+};
+
 struct Driver {
   const Source source;
-  std::vector<Error> errors;
+  Options opts;
+  Diagnostics diags;
   std::vector<Error> beacons;
+  // Results of earlier compilations to reuse, if any.
+  QueryCache *cache = nullptr;
+  // Keywords and builtins shared with other compilations, if any.
+  const Prelude *prelude = nullptr;
+  // Memory to reuse from an earlier compilation, if any.
+  SemaArena *arena = nullptr;
 
   // Construct from a filepath.
-  Driver(const Path &path) : source{path} {}
+  Driver(const Path &path, const Options &o = {}) : source{path}, opts{o} {}
   // Construct from a string text.
-  Driver(const std::string &text) : source{text} {};
-  static Driver from_path(const Path &path) { return Driver{path}; }
-  static Driver from_text(const std::string &text) { return Driver{text}; }
+  Driver(const std::string &text, const Options &o = {})
+      : source{text}, opts{o} {};
+  static Driver from_path(const Path &path, const Options &o = {}) {
+    return Driver{path, o};
+  }
+  static Driver from_text(const std::string &text, const Options &o = {}) {
+    return Driver{text, o};
+  }
 
   bool compile();
-  void report() const;
+  // Print the diagnostics of the compilation.
+  void report();
+  // Check the diagnostics against the error beacons in the source, and print
+  // the ones that do not match.  Return true if all of them match.
   bool verify();
-  bool no_errors() const { return errors.empty(); }
+  bool no_errors() const { return diags.empty(); }
+
+private:
+  // compile(), with the time of each phase recorded in `timing` if not null.
+  bool run_phases(TimeReport *timing);
 };
 
+// Recompile `path` every time it changes, reusing the results for the parts
+// that did not change.  Never returns.
+[[noreturn]] void watch(const Path &path, const Options &opts);
+
+// Path of the QBE executable that turns the generated code into assembly.
+std::string qbe_path();
+
 #endif
@@ -109,9 +109,33 @@ Token Lexer::lex_string() {
 Token Lexer::lex_comment() {
     skip_while([](char c) { return c != '\n'; });
     auto tok = make_token_with_literal(Tok::comment);
+    if (beacons) {
+        add_beacon(tok);
+    }
     return tok;
 }
 
+void Lexer::add_beacon(const Token &comment) {
+    std::string_view text{comment.start,
+                          static_cast<size_t>(comment.end - comment.start)};
+    for (std::string_view prefix : {"//~error:", "// ERROR:"}) {
+        if (text.substr(0, prefix.size()) != prefix) {
+            continue;
+        }
+        auto msg = text.substr(prefix.size());
+        while (!msg.empty() &&
+               std::isspace(static_cast<unsigned char>(msg.front()))) {
+            msg.remove_prefix(1);
+        }
+        while (!msg.empty() &&
+               std::isspace(static_cast<unsigned char>(msg.back()))) {
+            msg.remove_suffix(1);
+        }
+        beacons->emplace_back(src.locate(comment.pos), std::string{msg});
+        return;
+    }
+}
+
 Token Lexer::lex_symbol() {
     for (auto &p : symbol_map) {
         auto text = p.first;
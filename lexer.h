@@ -2,6 +2,7 @@
 #ifndef CMP_LEXER_H
 #define CMP_LEXER_H
 
+#include "error.h"
 #include "source.h"
 
 namespace cmp {
@@ -138,6 +139,9 @@ public:
     const char *curr;             // start of the current token
     std::vector<size_t> line_off; // offsets of each newline
     size_t num_ident = 0;         // number of identifiers found
+    // If set, error beacons found in comments ("//~error: msg" or
+    // "// ERROR: msg") are appended here, in source order.
+    std::vector<Error> *beacons = nullptr;
 
     Lexer(const Source &s)
         : src(s), sv(src.buf.data(), src.buf.size()), look(std::cbegin(sv)),
@@ -156,6 +160,7 @@ private:
     Token lex_number();
     Token lex_string();
     Token lex_comment();
+    void add_beacon(const Token &comment);
     Token lex_symbol();
 
     // Advance lex position by one character.
@@ -1,17 +1,246 @@
 #include "driver.h"
+#include "disk_cache.h"
+#include "parallel.h"
+#include "sema.h"
+#include "server.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
 
 using namespace cmp;
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "error: no filename specified\n");
-    return 1;
+// Append the arguments in `argv` to `args`, replacing each @FILE with the
+// whitespace-separated words in FILE.
+static bool expand_args(int argc, char **argv, std::vector<std::string> &args) {
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] != '@') {
+      args.push_back(argv[i]);
+      continue;
+    }
+    std::ifstream in{argv[i] + 1};
+    if (!in) {
+      fprintf(stderr, "error: cannot read response file '%s'\n", argv[i] + 1);
+      return false;
+    }
+    for (std::string word; in >> word;) {
+      args.push_back(word);
+    }
+  }
+  return true;
+}
+
+// Path of the executable made from `filename` in a batch: the same path
+// without the .ruse extension.
+static std::string batch_output(const std::string &filename) {
+  auto dot = filename.rfind('.');
+  auto slash = filename.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash) ||
+      filename.compare(dot, std::string::npos, ".ruse") != 0) {
+    return filename + ".out";
+  }
+  return filename.substr(0, dot);
+}
+
+// Compile every file of `filenames` in this process, `opts.jobs` files at a
+// time.  The files share the prelude, and each thread reuses the memory of the
+// Sema of its previous file.
+static int compile_batch(const std::vector<std::string> &filenames,
+                         const Options &opts, const Prelude *prelude) {
+  std::unique_ptr<Prelude> own_prelude;
+  if (!prelude) {
+    own_prelude = std::make_unique<Prelude>();
+    prelude = own_prelude.get();
+  }
+
+  unsigned threads = std::min<size_t>(opts.jobs, filenames.size());
+  std::vector<std::unique_ptr<SemaArena>> arenas;
+  for (unsigned t = 0; t < threads; t++) {
+    arenas.push_back(std::make_unique<SemaArena>(prelude));
+  }
+
+  std::atomic<bool> ok{true};
+  parallel_for(threads, filenames.size(), [&](unsigned w, size_t i) {
+    Options file_opts = opts;
+    file_opts.output = batch_output(filenames[i]);
+    // The threads are spent on the files instead.
+    file_opts.jobs = 1;
+    Driver d{Path{filenames[i]}, file_opts};
+    d.prelude = prelude;
+    d.arena = arenas[w].get();
+    if (!d.compile() && !opts.verify) {
+      ok = false;
+    }
+    if (opts.verify && !d.verify()) {
+      ok = false;
+    }
+  });
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Compile `filenames`, all at once or one by one.
+static int compile_files(const std::vector<std::string> &filenames,
+                         const Options &opts, const Prelude *prelude) {
+  if (filenames.size() > 1) {
+    return compile_batch(filenames, opts, prelude);
+  }
+
+  if (opts.watch) {
+    watch(Path{filenames[0]}, opts);
   }
 
   // XXX: We don't even need to declare Driver variables, why not make these
   // free functions?
-  auto d1 = Driver::from_path(Path{argv[1]});
-  d1.compile();
+  auto d1 = Driver::from_path(Path{filenames[0]}, opts);
+  d1.prelude = prelude;
+  bool success = d1.compile();
+  if (opts.verify) {
+    success = d1.verify();
+  }
+  if (!success) {
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
+
+// Compile as told by the command line.  `prelude` is the shared state of a
+// compile server, if this runs in one.
+static int run(int argc, char **argv, const Prelude *prelude) {
+  Options opts;
+  std::vector<std::string> args;
+  std::vector<std::string> filenames;
+  bool has_output = false;
+  std::string trace_path;
+
+  if (!expand_args(argc, argv, args)) {
+    return 1;
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    const char *arg = args[i].c_str();
+    if (strcmp(arg, "-fmem-report") == 0) {
+      opts.mem_report = true;
+    } else if (strcmp(arg, "-fdemand-driven") == 0) {
+      opts.demand_driven = true;
+    } else if (strcmp(arg, "-fwatch") == 0) {
+      opts.watch = true;
+    } else if (strcmp(arg, "-fcache") == 0) {
+      opts.cache_dir = DiskCache::default_dir();
+    } else if (strncmp(arg, "-fcache-dir=", 12) == 0) {
+      opts.cache_dir = arg + 12;
+    } else if (strncmp(arg, "-ferror-limit=", 14) == 0) {
+      opts.diag.error_limit = atoi(arg + 14);
+    } else if (strcmp(arg, "-fdiagnostics-format=json") == 0) {
+      opts.diag.json = true;
+    } else if (strcmp(arg, "-fdiagnostics-format=text") == 0) {
+      opts.diag.json = false;
+    } else if (strcmp(arg, "-ftime-report") == 0) {
+      opts.time_report = 10;
+    } else if (strncmp(arg, "-ftime-report=", 14) == 0) {
+      opts.time_report = atoi(arg + 14);
+    } else if (strcmp(arg, "-fperf-counters") == 0) {
+      opts.perf_counters = true;
+    } else if (strncmp(arg, "-ftrace=", 8) == 0) {
+      trace_path = arg + 8;
+    } else if (strcmp(arg, "-fverify") == 0) {
+      opts.verify = true;
+    } else if (strcmp(arg, "-v") == 0) {
+      opts.verbose = true;
+    } else if (strcmp(arg, "-o") == 0) {
+      if (i + 1 == args.size()) {
+        fprintf(stderr, "error: missing path after '-o'\n");
+        return 1;
+      }
+      opts.output = args[++i];
+      has_output = true;
+    } else if (strncmp(arg, "-j", 2) == 0) {
+      int jobs = atoi(arg + 2);
+      if (jobs < 1) {
+        fprintf(stderr, "error: invalid job count '%s'\n", arg + 2);
+        return 1;
+      }
+      opts.jobs = jobs;
+    } else if (arg[0] == '-') {
+      fprintf(stderr, "error: unknown option '%s'\n", arg);
+      return 1;
+    } else {
+      filenames.push_back(args[i]);
+    }
+  }
+  if (filenames.empty()) {
+    fprintf(stderr, "error: no filename specified\n");
+    return 1;
+  }
+  // The counters are printed in the time report.
+  if (opts.perf_counters && !opts.time_report) {
+    opts.time_report = 10;
+  }
+  if (filenames.size() > 1 && (has_output || opts.watch)) {
+    fprintf(stderr, "error: '%s' cannot be used with multiple files\n",
+            has_output ? "-o" : "-fwatch");
+    return 1;
+  }
+  if (trace_path.empty()) {
+    return compile_files(filenames, opts, prelude);
+  }
+
+#ifndef RUSE_TRACING
+  fprintf(stderr, "error: -ftrace needs a build with RUSE_TRACING\n");
+  return 1;
+#endif
+  if (opts.watch) {
+    // The trace is written when the compilation ends, which it never does.
+    fprintf(stderr, "error: '-ftrace' cannot be used with '-fwatch'\n");
+    return 1;
+  }
+  Tracer trace;
+  tracer = &trace;
+  int status = compile_files(filenames, opts, prelude);
+  tracer = nullptr;
+  if (!trace.write(trace_path)) {
+    fprintf(stderr, "error: cannot write trace to '%s'\n", trace_path.c_str());
+    return 1;
+  }
+  return status;
+}
+
+// If `arg` is `flag` or `flag`=PATH, return true and set `socket_path`.
+static bool socket_flag(const char *arg, const char *flag,
+                        std::string &socket_path) {
+  size_t len = strlen(flag);
+  if (strncmp(arg, flag, len) != 0 || (arg[len] && arg[len] != '=')) {
+    return false;
+  }
+  socket_path = arg[len] ? arg + len + 1 : default_socket_path();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::string socket_path;
+
+  // ruse --server[=SOCKET]: serve compile requests from clients.
+  if (argc > 1 && socket_flag(argv[1], "--server", socket_path)) {
+    if (socket_path.empty()) {
+      return EXIT_FAILURE;
+    }
+    Prelude prelude;
+    return serve(socket_path, [&](int argc, char **argv) {
+      return run(argc, argv, &prelude);
+    });
+  }
+
+  // ruse --client[=SOCKET] ARGS...: have the server compile ARGS, or compile
+  // them here if there is no server.
+  if (argc > 1 && socket_flag(argv[1], "--client", socket_path)) {
+    int status =
+        socket_path.empty() ? -1 : request(socket_path, argc - 1, argv + 1);
+    if (status >= 0) {
+      return status;
+    }
+    return run(argc - 1, argv + 1, nullptr);
+  }
+
+  return run(argc, argv, nullptr);
+}
@@ -0,0 +1,128 @@
+#ifndef CMP_PARALLEL_H
+#define CMP_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cmp {
+
+// Call `fn(worker, i)` for every i in [0, n) on `threads` threads, and return
+// when all of them are done.  `worker` is in [0, threads) and identifies the
+// calling thread, so that `fn` can keep per-thread state in an array.
+//
+// Items are handed out one at a time from a shared counter, so items of very
+// different costs still spread evenly.  The calling thread is worker 0.  The
+// threads are started and joined by each call; see ThreadPool for running
+// many loops.
+inline void parallel_for(unsigned threads, size_t n,
+                         const std::function<void(unsigned, size_t)> &fn) {
+    std::atomic<size_t> next{0};
+    auto run = [&](unsigned worker) {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;) {
+            fn(worker, i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(run, t);
+    }
+    run(0);
+    for (auto &t : pool) {
+        t.join();
+    }
+}
+
+// A fixed set of threads for running many parallel loops one after another,
+// such as the waves of a demand-driven typecheck, without starting threads for
+// each of them.  The threads sleep between loops, and are joined when the pool
+// is destroyed.
+class ThreadPool {
+public:
+    // `threads` counts the calling thread, which is worker 0 of every loop.
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned t = 1; t < threads; t++) {
+            pool.emplace_back([this, t] { work(t); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    unsigned size() const { return pool.size() + 1; }
+
+    // Same as the free parallel_for() on size() threads.  Only one thread may
+    // call this at a time.
+    void parallel_for(size_t n,
+                      const std::function<void(unsigned, size_t)> &fn) {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            job = &fn;
+            count = n;
+            next = 0;
+            busy = pool.size();
+            generation++;
+        }
+        wake.notify_all();
+        run(0);
+        std::unique_lock<std::mutex> lock{mutex};
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    void run(unsigned worker) {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) <
+                       count;) {
+            (*job)(worker, i);
+        }
+    }
+
+    void work(unsigned worker) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock{mutex};
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            run(worker);
+            lock.lock();
+            if (--busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> pool;
+    std::mutex mutex;
+    std::condition_variable wake; // a loop started, or the pool is stopping
+    std::condition_variable done; // every thread finished the loop
+    // The loop being run.  Written under `mutex` before `generation` is bumped,
+    // so the threads read it after seeing the new generation.
+    const std::function<void(unsigned, size_t)> *job = nullptr;
+    size_t count = 0;
+    std::atomic<size_t> next{0};
+    uint64_t generation = 0;
+    unsigned busy = 0; // threads other than the caller still in the loop
+    bool stopping = false;
+};
+
+} // namespace cmp
+
+#endif
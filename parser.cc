@@ -1,29 +1,48 @@
 #include "parser.h"
+#include "alloc_profile.h"
 #include "ast.h"
 #include "fmt/core.h"
+#include "trace.h"
 #include <cassert>
 
 namespace cmp {
 
+namespace {
+
+// Thrown by fatal() to unwind out of the parse.
+struct ParseError {};
+
+// Name of a toplevel declaration, for tracing.
+[[maybe_unused]] const char *toplevel_name(const AstNode *n) {
+    if (n && n->kind == AstKind::decl) {
+        if (auto name = static_cast<const Decl *>(n)->name) {
+            return name->text;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
 Parser::Parser(Lexer &l, Sema &sema) : lexer{l}, sema(sema) {
-    // insert keywords in name table
-    for (auto m : keyword_map)
-        sema.name_table.push(m.first);
+    // insert keywords in name table, unless the prelude already has them
+    if (!sema.prelude) {
+        for (auto m : keyword_map)
+            sema.name_table.push(m.first);
+    }
 
     // set up lookahead and cache
     next();
 }
 
-void Parser::error(const std::string &msg) {
-    auto srcloc = locate();
-    sema.errors.push_back({srcloc, msg});
-    fmt::print(stderr, "{}:{}:{}: {}\n", srcloc.filename, srcloc.line, srcloc.col, msg);
-    exit(EXIT_FAILURE);
+void Parser::fatal() {
+    // The arguments may point into temporaries of the caller.
+    sema.diags.save_args();
+    throw ParseError{};
 }
 
-void Parser::error_expected(const std::string &msg) {
-    std::string s = fmt::format("expected {}, found '{}'", msg, tok.str());
-    error(s);
+void Parser::error_expected(const char *what) {
+    error(Diag::expected, what, tok.str().c_str());
 }
 
 void Parser::next() {
@@ -42,27 +61,26 @@ void Parser::next() {
 }
 
 Parser::State Parser::save_state() {
-    return State{tok, last_tok_endpos, next_read_pos, sema.errors.size()};
+    return State{tok, last_tok_endpos, next_read_pos, sema.diags.size()};
 }
 
 void Parser::restore_state(State state) {
     tok = state.tok;
     last_tok_endpos = state.last_tok_endpos;
     next_read_pos = state.next_read_pos;
-    sema.errors.resize(state.error_count);
+    sema.diags.list.resize(state.error_count);
 }
 
 // Returns true if match succeeded, false otherwise.
-bool Parser::expect(Tok kind, const std::string &msg = "") {
+bool Parser::expect(Tok kind, Diag id) {
     if (tok.kind != kind) {
-        std::string s = msg;
-        if (msg.empty()) {
-            s = fmt::format(
-                "expected '{}', found '{}'", tokenTypeToString(kind),
-                std::string{tok.start,
-                            static_cast<size_t>(tok.end - tok.start)});
+        if (id == Diag::expected_token) {
+            error(id, tokenTypeToString(kind).c_str(),
+                  std::string{tok.start,
+                              static_cast<size_t>(tok.end - tok.start)}
+                      .c_str());
         }
-        error(s);
+        error(id);
         // Don't make progress if the match failed.
         // Note: the Go compiler does otherwise. Is that necessary?
         return false;
@@ -196,7 +214,7 @@ Stmt *Parser::parse_expr_or_assign_stmt() {
     if (tok.kind == Tok::reversearrow) {
         move = true;
         next();
-    } else if (!expect(Tok::equals, "expected '=' or '\\n' after expression")) {
+    } else if (!expect(Tok::equals, Diag::expected_assign)) {
         skip_until_end_of_line();
         expect(Tok::newline);
         return sema.make_node_pos<BadStmt>(pos);
@@ -215,8 +233,9 @@ Stmt *Parser::parse_expr_or_assign_stmt() {
 // CompoundStmt:
 //     { Stmt* }
 CompoundStmt *Parser::parse_compound_stmt() {
+    auto pos = tok.pos;
     expect(Tok::lbrace);
-    auto compound = sema.make_node<CompoundStmt>();
+    auto compound = sema.make_node_pos<CompoundStmt>(pos);
 
     while (!is_eos()) {
         skip_newlines();
@@ -306,8 +325,7 @@ std::vector<T> Parser::parse_comma_separated_list(F &&parse_fn) {
             // For cases when a VarDecl succeeds parsing but there is a leftover
             // token, e.g. 'a: int###', we need to directly check the next token
             // is the delimiting token, and do an appropriate error report.
-            error(fmt::format("trailing token '{}' after declaration",
-                              tok.str()));
+            error(Diag::trailing_token, tok.str().c_str());
             skip_until_any(delimiters);
         }
 
@@ -344,6 +362,7 @@ FuncDecl *Parser::parse_func_header() {
         next();
         func->rettypeexpr = parse_type_expr();
     }
+    func->endpos = last_tok_endpos;
 
     return func;
 }
@@ -381,7 +400,7 @@ StructDecl *Parser::parse_struct_decl() {
 
     auto fields = parse_comma_separated_list<VarDecl *>(
         [this] { return parse_var_decl(VarDeclKind::struct_); });
-    expect(Tok::rbrace, "unterminated struct declaration");
+    expect(Tok::rbrace, Diag::unterminated_struct);
     // TODO: recover
 
     return sema.make_node_pos<StructDecl>(pos, name, fields);
@@ -436,7 +455,7 @@ EnumDecl *Parser::parse_enum_decl() {
     if (!expect(Tok::lbrace))
         skip_until_end_of_line();
     auto fields = parse_enum_variant_decl_list();
-    expect(Tok::rbrace, "unterminated enum declaration");
+    expect(Tok::rbrace, Diag::unterminated_enum);
     // TODO: recover
 
     return sema.make_node_pos<EnumDecl>(pos, name, fields);
@@ -570,30 +589,6 @@ Expr *Parser::parse_cast_expr() {
     return make_node_range<CastExpr>(pos, type_expr, target_expr);
 }
 
-// Get the Name handle that designates a reference type of a given referee type
-// name.  This function is used in the typechecking phase to query
-// already-declared reference types from the type table. TODO: looks kinda like
-// an unnecessary step.
-Name *name_of_derived_type(NameTable &names, TypeKind kind,
-                           Name *referee_name) {
-    std::string prefix;
-    switch (kind) {
-    case TypeKind::var_ref:
-        prefix = "var *";
-        break;
-    case TypeKind::ref:
-        prefix = "*";
-        break;
-    case TypeKind::ptr:
-        prefix = "*";
-        break;
-    default:
-        assert(false && "unreachable");
-    }
-    prefix += referee_name->text;
-    return names.push(prefix.c_str());
-}
-
 // Parse a type expression.
 // A type expression is simply every stream of tokens in the source that can
 // represent a type.
@@ -610,9 +605,9 @@ Expr *Parser::parse_type_expr() {
     }
 
     TypeKind type_kind = TypeKind::value;
+    Name *name = nullptr;
     Name *lt_name = nullptr;
     Expr *subexpr = nullptr;
-    std::string text;
     if (tok.kind == Tok::star) {
         next();
         type_kind = mut ? TypeKind::var_ref : TypeKind::ref;
@@ -624,26 +619,14 @@ Expr *Parser::parse_type_expr() {
         }
         // Base type name.
         subexpr = parse_type_expr();
-        // FIXME: unnatural
-        if (subexpr->kind == ExprKind::type) {
-            text = name_of_derived_type(sema.name_table,
-                                        mut ? TypeKind::var_ref : TypeKind::ref,
-                                        subexpr->as<TypeExpr>()->name)
-                       ->text;
-        }
     } else if (tok.kind == Tok::star) {
         next();
         type_kind = TypeKind::ptr;
         subexpr = parse_type_expr();
-        if (subexpr->kind == ExprKind::type) {
-            text = name_of_derived_type(sema.name_table, TypeKind::ptr,
-                                        subexpr->as<TypeExpr>()->name)
-                       ->text;
-        }
     } else if (is_ident_or_keyword(tok)) {
         type_kind = TypeKind::value;
 
-        text = std::string{tok.start, static_cast<size_t>(tok.end - tok.start)};
+        name = push_token(sema, tok);
         next();
 
         subexpr = nullptr;
@@ -652,8 +635,6 @@ Expr *Parser::parse_type_expr() {
         return sema.make_node_pos<BadExpr>(pos);
     }
 
-    Name *name = sema.name_table.push(text.c_str());
-
     return sema.make_node_pos<TypeExpr>(pos, type_kind, name, mut, lt_name,
                                         subexpr);
 }
@@ -847,7 +828,7 @@ Expr *Parser::parse_structdef_maybe(Expr *expr) {
     auto pos = tok.pos;
 
     if (expr->kind != ExprKind::decl_ref) {
-        error("qualified struct names are not yet supported");
+        error(Diag::qualified_struct_name);
     }
     auto declrefexpr = static_cast<DeclRefExpr *>(expr);
 
@@ -917,9 +898,9 @@ AstNode *Parser::parse_toplevel() {
     case Tok::kw_extern:
         return parse_extern_decl();
     default:
-        error(fmt::format(
-            "unexpected '{}' at toplevel",
-            std::string{tok.start, static_cast<size_t>(tok.end - tok.start)}));
+        error(Diag::unexpected_toplevel,
+              std::string{tok.start, static_cast<size_t>(tok.end - tok.start)}
+                  .c_str());
         skip_to_next_line();
         return nullptr;
     }
@@ -931,10 +912,14 @@ File *Parser::parse_file() {
     skip_newlines();
 
     while (!is_eos()) {
+        TRACE_SPAN(span, "parse", "toplevel");
         auto toplevel = parse_toplevel();
+        TRACE_DETAIL(span, toplevel_name(toplevel));
         if (!toplevel) {
             continue;
         }
+        // Used to fingerprint the text of each toplevel.
+        toplevel->endpos = last_tok_endpos;
         file->toplevels.push_back(toplevel);
         skip_newlines();
     }
@@ -943,7 +928,12 @@ File *Parser::parse_file() {
 }
 
 AstNode *Parser::parse() {
-    return parse_file();
+    ALLOC_SCOPE(parser);
+    try {
+        return parse_file();
+    } catch (const ParseError &) {
+        return nullptr;
+    }
 }
 
 } // namespace cmp
@@ -8,8 +8,6 @@
 
 namespace cmp {
 
-Name *name_of_derived_type(NameTable &names, TypeKind kind, Name *referee_name);
-
 class Parser {
 public:
     Lexer &lexer;
@@ -88,15 +86,20 @@ private:
     bool lookahead_structdef();
     Expr *parse_structdef_maybe(Expr *expr);
 
-    // Error handling
-    void error(const std::string &msg);
-    void error_expected(const std::string &msg);
+    // Error handling.  Parse errors are fatal: parsing stops, and parse()
+    // returns null with the diagnostics found so far.
+    template <typename... Args> [[noreturn]] void error(Diag id, Args... args) {
+        sema.diags.report(tok.pos, id, args...);
+        fatal();
+    }
+    [[noreturn]] void error_expected(const char *what);
+    [[noreturn]] void fatal();
 
     // Advance the lookahead token.
     void next();
 
     // Expect and consume functions.
-    bool expect(Tok kind, const std::string &msg);
+    bool expect(Tok kind, Diag id = Diag::expected_token);
 
     // Skip until a specific token(s) show up.
     void skip_until(Tok kind);
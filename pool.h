@@ -0,0 +1,88 @@
+#ifndef CMP_POOL_H
+#define CMP_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace cmp {
+
+// Typed slab allocator.
+//
+// Objects are constructed in fixed-size slabs that are never moved, so the
+// returned pointers stay valid until the object is released.  Allocation is
+// stack-ordered: mark() records the current top, and rewind() destroys every
+// object made after that mark in reverse order.  The slabs themselves are kept
+// around, so a pool that is repeatedly rewound (e.g. per function) stops
+// calling malloc() once it has warmed up.
+template <typename T, size_t SlabSize = 256> class SlabPool {
+public:
+    struct Mark {
+        size_t top;
+    };
+
+    SlabPool() = default;
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+    ~SlabPool() { reset(); }
+
+    template <typename... Args> T *make(Args &&...args) {
+        if (top == slabs.size() * SlabSize) {
+            slabs.emplace_back(new Slot[SlabSize]);
+        }
+        T *p = at(top);
+        new (p) T{std::forward<Args>(args)...};
+        top++;
+        if (top > peak) {
+            peak = top;
+        }
+        return p;
+    }
+
+    Mark mark() const { return Mark{top}; }
+
+    // Destroy all objects made after `m`.  Their memory is reused by the
+    // subsequent make()s.
+    void rewind(Mark m) {
+        while (top > m.top) {
+            top--;
+            at(top)->~T();
+        }
+    }
+
+    // Destroy all objects but keep the slabs.
+    void reset() { rewind(Mark{0}); }
+
+    // Exchange the objects and slabs of two pools.
+    void swap(SlabPool &other) {
+        slabs.swap(other.slabs);
+        std::swap(top, other.top);
+        std::swap(peak, other.peak);
+    }
+
+    // Number of live objects, and its high-water mark.
+    size_t size() const { return top; }
+    size_t peak_size() const { return peak; }
+    // Bytes reserved by the slabs.
+    size_t capacity_bytes() const { return slabs.size() * SlabSize * sizeof(T); }
+
+    // Access the i-th live object in allocation order.
+    T *at(size_t i) const {
+        return reinterpret_cast<T *>(&slabs[i / SlabSize][i % SlabSize]);
+    }
+
+private:
+    struct Slot {
+        alignas(T) unsigned char bytes[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    size_t top = 0;
+    size_t peak = 0;
+};
+
+} // namespace cmp
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef CMP_QUERY_H
+#define CMP_QUERY_H
+
+#include "diagnostic.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cmp {
+
+// Memoized results of compiling each toplevel function, kept across
+// compilations of the same file (e.g. in watch mode) so that a recompilation
+// only redoes the functions whose inputs changed.
+//
+// Parsing and the declaration and signature passes are linear and always rerun;
+// they produce the AST that the queries below are validated against.  The
+// queries are:
+//
+//   - "checked body of X": the diagnostics and callees of checking the body of
+//     function X.  It depends on the text of X, and on the interface of each
+//     global declaration that the body used: the signature of a function and
+//     the whole text of anything else.
+//   - "QBE text of X": depends only on the text of X.
+//
+// Entries are keyed by the function name, and store hashes of their inputs as
+// of when they were computed.  An entry whose recorded inputs no longer match
+// is recomputed.
+struct QueryCache {
+    struct FuncResult {
+        // Hash of the text of the function.
+        uint64_t text_hash = 0;
+        // (name, interface hash) of each global that the body used.
+        std::vector<std::pair<std::string, uint64_t>> deps;
+        // Names that the body looked up and found undeclared.  Declaring any
+        // of them invalidates the entry.
+        std::vector<std::string> missing;
+        // Diagnostics of the body.  Positions are relative to the start of the
+        // function, so that the entry survives edits above it, and arguments
+        // are formatted, so that it survives the compilation that made it.
+        struct SavedDiag {
+            Diag id;
+            size_t offset;
+            size_t nargs = 0;
+            std::string args[MAX_DIAG_ARGS];
+        };
+        std::vector<SavedDiag> diags;
+        // Functions called from the body, for demand-driven checking.
+        std::vector<std::string> callees;
+        // Generated QBE text, if any.
+        bool has_qbe = false;
+        std::string qbe;
+    };
+    std::unordered_map<std::string, FuncResult> funcs;
+
+    // Statistics of the last compilation.
+    struct Stats {
+        size_t body_hits = 0;
+        size_t body_misses = 0;
+        size_t qbe_hits = 0;
+        size_t qbe_misses = 0;
+    } stats;
+};
+
+} // namespace cmp
+
+#endif
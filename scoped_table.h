@@ -1,30 +1,69 @@
 #ifndef CMP_SCOPED_TABLE_H
 #define CMP_SCOPED_TABLE_H
 
-#include <array>
+#include "alloc_profile.h"
+#include "pool.h"
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <type_traits>
 #include <vector>
 
 namespace cmp {
 
+// ref: https://stackoverflow.com/a/12996028
+static inline uint64_t hash(const void *p) {
+    uint64_t x = (uint64_t)p;
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    x = x ^ (x >> 31);
+    return x;
+}
+
+// Mix the hash `h` of another key field into `seed`.  For writing Hash
+// policies of struct keys.
+static inline uint64_t hash_combine(uint64_t seed, uint64_t h) {
+    return seed ^ (h + UINT64_C(0x9e3779b97f4a7c15) + (seed << 6) + (seed >> 2));
+}
+
+// Default hash policy of ScopedTable, which only handles pointer keys.
+template <typename Key> struct ScopedTableHash {
+    static_assert(std::is_pointer_v<Key>,
+                  "non-pointer keys need a custom Hash policy");
+    uint64_t operator()(const Key key) const { return hash(key); }
+};
+
 // Scoped symbol table.
-constexpr int SYMBOL_TABLE_BUCKET_COUNT = 512;
-template <typename Key, typename T> struct ScopedTable {
+//
+// Keys are hashed and compared through the `Hash` and `Eq` policies, so a
+// struct can be a key as well as a pointer.
+//
+// The bucket array starts small and doubles whenever the number of live
+// symbols exceeds the number of buckets, so that chains stay short no matter
+// how many globals a file declares.  Bucket chains are doubly linked: symbols
+// of different scopes can interleave in a bucket, and closing a scope has to
+// unlink each of them wherever it is in the chain.
+constexpr size_t SYMBOL_TABLE_INITIAL_BUCKET_COUNT = 64;
+template <typename Key, typename T, typename Hash = ScopedTableHash<Key>,
+          typename Eq = std::equal_to<Key>>
+struct ScopedTable {
     struct Symbol {
         const Key key;           // name of this symbol
         T value;                 // semantic value of this symbol (owned)
         Symbol *next = nullptr;  // next symbol in the hash table bucket
+        Symbol *prev = nullptr;  // previous symbol in the hash table bucket
         Symbol *cross = nullptr; // next symbol in the same scope
         int scope_level = 0;
 
-        Symbol(const Key k, const T &v) : key(k), value(v) {}
+        Symbol(const Key &k, const T &v) : key(k), value(v) {}
     };
 
     ScopedTable();
     ~ScopedTable();
-    T *insert(const Key key, const T &value);
+    T *insert(const Key &key, const T &value);
 
-    // Note that `find(nullptr)` always returns nullptr.
-    Symbol *find(const Key key) const;
+    // Note that for pointer keys, `find(nullptr)` always returns nullptr.
+    Symbol *find(const Key &key) const;
 
     void print() const;
 
@@ -33,73 +72,107 @@ template <typename Key, typename T> struct ScopedTable {
     // Close current cope.
     void scope_close();
 
-    std::array<Symbol *, SYMBOL_TABLE_BUCKET_COUNT> keys;
-    std::vector<Symbol *> scope_stack = {};
+    // Hash buckets.  The size is always a power of two.
+    std::vector<Symbol *> keys;
+    // Head of the symbol chain of each open scope, and the position of the
+    // symbol pool when that scope was opened.
+    struct Scope {
+        Symbol *head;
+        typename SlabPool<Symbol>::Mark mark;
+    };
+    std::vector<Scope> scope_stack = {};
     int curr_scope_level = 0;
+
+    // Symbols are allocated as a stack, so closing a scope releases all of its
+    // symbols at once by rewinding the pool.
+    SlabPool<Symbol> symbol_pool;
+
+    // Number of symbols currently in the table, and its high-water mark.
+    size_t live_count = 0;
+    size_t peak_count = 0;
+
+private:
+    size_t bucket_of(const Key &key) const {
+        return Hash{}(key) & (keys.size() - 1);
+    }
+    void link(Symbol *s);
+    void unlink(Symbol *s);
+    void grow();
 };
 
-// ref: https://stackoverflow.com/a/12996028
-static inline uint64_t hash(const void *p) {
-    uint64_t x = (uint64_t)p;
-    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
-    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
-    x = x ^ (x >> 31);
-    return x;
+template <typename Key, typename T, typename Hash, typename Eq>
+ScopedTable<Key, T, Hash, Eq>::ScopedTable()
+    : keys(SYMBOL_TABLE_INITIAL_BUCKET_COUNT, nullptr) {
+    // Reserve enough levels up front that opening a scope does not allocate
+    // in practice.
+    scope_stack.reserve(64);
+    scope_stack.push_back({nullptr, symbol_pool.mark()});
 }
 
-template <typename Key, typename T> ScopedTable<Key, T>::ScopedTable() {
-    for (int i = 0; i < SYMBOL_TABLE_BUCKET_COUNT; i++) {
-        keys[i] = nullptr;
+// Symbols still in the table are destroyed along with symbol_pool.
+template <typename Key, typename T, typename Hash, typename Eq>
+ScopedTable<Key, T, Hash, Eq>::~ScopedTable() {}
+
+// Push `s` to the front of its bucket.
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::link(Symbol *s) {
+    Symbol **p = &keys[bucket_of(s->key)];
+    s->prev = nullptr;
+    s->next = *p;
+    if (*p) {
+        (*p)->prev = s;
     }
-    scope_stack.push_back(nullptr);
+    *p = s;
 }
 
-template <typename Key, typename T> ScopedTable<Key, T>::~ScopedTable() {
-    for (int i = 0; i < SYMBOL_TABLE_BUCKET_COUNT; i++) {
-        Symbol *p = keys[i];
-        if (!p) {
-            continue;
-        }
-        while (p) {
-            auto *next = p->next;
-            delete p;
-            p = next;
-        }
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::unlink(Symbol *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        keys[bucket_of(s->key)] = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
     }
 }
 
 // Insert symbol at the current scope level.
-template <typename Key, typename T>
-T *ScopedTable<Key, T>::insert(const Key key, const T &value) {
-    static_assert(sizeof(Key) == sizeof(uint64_t));
+template <typename Key, typename T, typename Hash, typename Eq>
+T *ScopedTable<Key, T, Hash, Eq>::insert(const Key &key, const T &value) {
+    ALLOC_SCOPE(scoped_table);
+    // Keep the load factor at or below 1.
+    if (live_count + 1 > keys.size()) {
+        grow();
+    }
 
     // memory for T is stored inside the symbol
-    // TODO: better allocator
-    Symbol *head = new Symbol(key, value);
-
-    // insert into the bucket
-    int index = hash(key) % SYMBOL_TABLE_BUCKET_COUNT;
-    Symbol **p = &keys[index];
-    head->next = *p;
-    *p = head;
+    Symbol *head = symbol_pool.make(key, value);
+    link(head);
 
     // set the scope chain
-    head->cross = scope_stack.back();
+    head->cross = scope_stack.back().head;
     head->scope_level = curr_scope_level;
-    scope_stack.back() = head;
+    scope_stack.back().head = head;
+
+    live_count++;
+    if (live_count > peak_count) {
+        peak_count = live_count;
+    }
     return &head->value;
 }
 
-template <typename Key, typename T>
-typename ScopedTable<Key, T>::Symbol *
-ScopedTable<Key, T>::find(const Key key) const {
-    if (!key) {
-        return nullptr;
+template <typename Key, typename T, typename Hash, typename Eq>
+typename ScopedTable<Key, T, Hash, Eq>::Symbol *
+ScopedTable<Key, T, Hash, Eq>::find(const Key &key) const {
+    if constexpr (std::is_pointer_v<Key>) {
+        if (!key) {
+            return nullptr;
+        }
     }
 
-    int index = hash(key) % SYMBOL_TABLE_BUCKET_COUNT;
-    for (Symbol *s = keys[index]; s; s = s->next) {
-        if (s->key == key) {
+    for (Symbol *s = keys[bucket_of(key)]; s; s = s->next) {
+        if (Eq{}(s->key, key)) {
             return s;
         }
     }
@@ -107,40 +180,53 @@ ScopedTable<Key, T>::find(const Key key) const {
     return nullptr;
 }
 
-template <typename Key, typename T> void ScopedTable<Key, T>::scope_open() {
-    scope_stack.push_back(nullptr);
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::scope_open() {
+    ALLOC_SCOPE(scoped_table);
+    scope_stack.push_back({nullptr, symbol_pool.mark()});
     curr_scope_level++;
 }
 
-template <typename Key, typename T> void ScopedTable<Key, T>::scope_close() {
-    Symbol *p = scope_stack.back();
-    while (p) {
-        // XXX: does this work with p->key = nullptr?
-        int index = hash(p->key) % SYMBOL_TABLE_BUCKET_COUNT;
-        keys[index] = p->next;
-        auto cross = p->cross;
-        delete p;
-        p = cross;
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::scope_close() {
+    for (Symbol *p = scope_stack.back().head; p; p = p->cross) {
+        unlink(p);
+        live_count--;
     }
+    symbol_pool.rewind(scope_stack.back().mark);
     scope_stack.pop_back();
     curr_scope_level--;
 }
 
-template <typename Key, typename T> void ScopedTable<Key, T>::print() const {
-    for (int i = 0; i < SYMBOL_TABLE_BUCKET_COUNT; i++) {
+// Double the bucket count and redistribute the symbols.
+//
+// The pool holds exactly the live symbols in insertion order, so re-inserting
+// them in that order puts newer symbols in front of older ones in every
+// bucket, which preserves shadowing.  Scope chains ('cross') are not touched.
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::grow() {
+    keys.assign(keys.size() * 2, nullptr);
+    for (size_t i = 0; i < symbol_pool.size(); i++) {
+        link(symbol_pool.at(i));
+    }
+}
+
+template <typename Key, typename T, typename Hash, typename Eq>
+void ScopedTable<Key, T, Hash, Eq>::print() const {
+    for (size_t i = 0; i < keys.size(); i++) {
         auto *p = keys[i];
         if (!p)
             continue;
 
-        printf("[%d]", i);
+        printf("[%zu]", i);
         for (; p; p = p->next) {
             printf("{%s}", p->value.str());
         }
         printf("\n");
     }
     for (size_t i = 0; i < scope_stack.size(); i++) {
-        printf("Scope %d:", i);
-        for (Symbol *p = scope_stack[i]; p; p = p->cross) {
+        printf("Scope %zu:", i);
+        for (Symbol *p = scope_stack[i].head; p; p = p->cross) {
             printf("{%s}", p->value.str());
         }
         printf("\n");
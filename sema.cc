@@ -1,30 +1,50 @@
 #include "sema.h"
 #include "ast.h"
 #include "ast_visitor.h"
+#include "disk_cache.h"
 #include "fmt/core.h"
+#include "parallel.h"
 #include "parser.h"
+#include "query.h"
 #include "source.h"
+#include "trace.h"
 #include "types.h"
+#include <optional>
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
+#include <cstring>
 
 #define BUFSIZE 1024
 
 using namespace cmp;
 
-template <typename... Args> static void error(SourceLoc loc, Args &&...args) {
-    auto message = fmt::format(std::forward<Args>(args)...);
-    fmt::print(stderr, "{}:{}:{}: error: {}\n", loc.filename, loc.line, loc.col,
-               message);
+template <typename... Args>
+static void error(Sema &sema, size_t pos, Diag id, Args... args) {
+    sema.diags.report(pos, id, args...);
     // Not exiting here makes the compiler go as far as it can and report all of
     // the errors it encounters.
     // exit(EXIT_FAILURE);
 }
 
-Type::Type(Name *n, TypeKind k, Type *rt) : kind(k), name(n), referee_type(rt) {
+Type::Type(TypeKind k, Type *rt) : kind(k), referee_type(rt) {
     copyable = k == TypeKind::ref;
 }
 
+std::string Type::str() const {
+    switch (kind) {
+    case TypeKind::value:
+        return name->text;
+    case TypeKind::ptr:
+    case TypeKind::ref:
+        return "*" + referee_type->str();
+    case TypeKind::var_ref:
+        return "var *" + referee_type->str();
+    }
+    unreachable();
+    return {};
+}
+
 bool Type::isEnum() const {
     // TODO: should base_type be null too?
     return kind == TypeKind::value && type_decl && type_decl->is<EnumDecl>();
@@ -34,22 +54,40 @@ StructDecl *Type::getStructDecl() { return type_decl->as<StructDecl>(); }
 EnumDecl *Type::getEnumDecl() { return type_decl->as<EnumDecl>(); }
 
 Type *make_builtin_type(Sema &sema, Name *n) {
-    Type *t = new Type(n);
-    sema.type_pool.push_back(t);
-    return t;
+    return sema.type_pool.make(n);
 }
 
 Type *make_value_type(Sema &sema, Name *n, Decl *decl) {
-    Type *t = new Type(TypeKind::value, n, decl);
-    sema.type_pool.push_back(t);
-    return t;
+    return sema.type_pool.make(TypeKind::value, n, decl);
+}
+
+Type *make_ref_type(Sema &sema, TypeKind ptr_kind, Type *referee_type) {
+    return sema.type_pool.make(ptr_kind, referee_type);
+}
+
+Type *ConcurrentTypeTable::get(TypeKind kind, Type *referee) {
+    DerivedTypeKey key{kind, referee};
+    // The low bits of the hash pick the bucket inside a shard.
+    Shard &shard = shards[DerivedTypeKeyHash{}(key) >> 60];
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    if (auto found = shard.table.find(key)) {
+        return found->value;
+    }
+    return *shard.table.insert(key, shard.type_pool.make(kind, referee));
 }
 
-Type *make_ref_type(Sema &sema, Name *name, TypeKind ptr_kind,
-                    Type *referee_type) {
-    Type *t = new Type(name, ptr_kind, referee_type);
-    sema.type_pool.push_back(t);
-    return t;
+SemaWorker::SemaWorker(Sema &parent)
+    : sema{parent.source, diags, parent.beacons, parent.prelude} {
+    // Only the global scope is open in the parent at this point, and its
+    // symbol pool lists the globals in declaration order.
+    auto &globals = parent.decl_table.symbol_pool;
+    for (size_t i = 0; i < globals.size(); i++) {
+        sema.decl_table.insert(globals.at(i)->key, globals.at(i)->value);
+    }
+    sema.context = parent.context;
+    sema.shared_types = parent.shared_types;
+    sema.demand_driven = parent.demand_driven;
+    sema.time_report = parent.time_report;
 }
 
 Type *push_builtin_type_from_name(Sema &s, const std::string &str) {
@@ -64,34 +102,80 @@ Type *push_builtin_type_from_name(Sema &s, const std::string &str) {
 // Push Decls for the builtin types into the global scope of decl_table, so
 // that they are visible from any point in the AST.
 void cmp::setup_builtin_types(Sema &s) {
+    if (s.prelude) {
+        for (auto d : s.prelude->decls) {
+            s.decl_table.insert(d->name, d);
+        }
+        s.context.void_type = s.prelude->context.void_type;
+        s.context.int_type = s.prelude->context.int_type;
+        s.context.char_type = s.prelude->context.char_type;
+        s.context.string_type = s.prelude->context.string_type;
+        return;
+    }
     s.context.void_type = push_builtin_type_from_name(s, "void");
     s.context.int_type = push_builtin_type_from_name(s, "int");
     s.context.char_type = push_builtin_type_from_name(s, "char");
     s.context.string_type = push_builtin_type_from_name(s, "string");
 }
 
-Sema::~Sema() {
-    for (auto t : type_pool) {
-        delete t;
+Prelude::Prelude() {
+    for (auto m : keyword_map) {
+        name_table.push(m.first);
     }
-    for (auto lt : lifetime_pool) {
-        delete lt;
+    auto push = [this](const char *str) {
+        Name *name = name_table.push(str);
+        auto struct_decl = new StructDecl{name, std::vector<VarDecl *>()};
+        node_pool.emplace_back(struct_decl);
+        struct_decl->type = type_pool.make(name);
+        decls.push_back(struct_decl);
+        return struct_decl->type;
+    };
+    context.void_type = push("void");
+    context.int_type = push("int");
+    context.char_type = push("char");
+    context.string_type = push("string");
+}
+
+Sema::Sema(const Source &s, Diagnostics &d, std::vector<Error> &b,
+           const Prelude *p, SemaArena *arena)
+    : source(s), prelude(p), name_table(p ? &p->name_table : nullptr),
+      diags(d), beacons(b), arena(arena) {
+    if (arena) {
+        assert(arena->prelude == p);
+        name_table.swap(arena->name_table);
+        node_pool.swap(arena->node_pool);
+        type_pool.swap(arena->type_pool);
+        lifetime_pool.swap(arena->lifetime_pool);
+        basic_block_pool.swap(arena->basic_block_pool);
     }
-    for (auto b : basic_block_pool) {
-        delete b;
+}
+
+Sema::~Sema() {
+    if (!arena) {
+        return;
     }
+    // Workers may refer to the nodes and types, so they go first.
+    workers.clear();
+    node_pool.clear();
+    type_pool.reset();
+    lifetime_pool.reset();
+    basic_block_pool.reset();
+    name_table.clear();
+    name_table.swap(arena->name_table);
+    node_pool.swap(arena->node_pool);
+    type_pool.swap(arena->type_pool);
+    lifetime_pool.swap(arena->lifetime_pool);
+    basic_block_pool.swap(arena->basic_block_pool);
 }
 
 void Sema::scope_open() {
     decl_table.scope_open();
-    type_table.scope_open();
     lifetime_table.scope_open();
     borrow_table.scope_open();
 }
 
 void Sema::scope_close() {
     decl_table.scope_close();
-    type_table.scope_close();
     lifetime_table.scope_close();
     borrow_table.scope_close();
 }
@@ -1045,8 +1129,7 @@ bool declare(Sema &sema, Name *name, Decl *decl) {
     auto found = sema.decl_table.find(name);
     if (found && found->value->kind == decl->kind &&
         found->scope_level == sema.decl_table.curr_scope_level) {
-        assert(false);
-        error(decl->loc, "redefinition of '{}'", name->text);
+        error(sema, decl->pos, Diag::redefinition, name->text);
         return false;
     }
 
@@ -1054,18 +1137,34 @@ bool declare(Sema &sema, Name *name, Decl *decl) {
     return true;
 }
 
+// Note that the body being checked depends on `d`, if it is a global.
+static void record_use(Sema &sema, Decl *d) {
+    auto sym = sema.decl_table.find(d->name);
+    if (sym && sym->value == d && sym->scope_level == 0) {
+        sema.used_globals.push_back(d);
+    }
+}
+
+// Note that the body being checked depends on `name` not being declared.
+static void record_missing(Sema &sema, Name *name) {
+    sema.missing_globals.push_back(name);
+}
+
 // Get or construct a derived type with kind `kind`, from a given type.
 //
 // Derived types are only present in the type table if they occur in the source
 // code.  Trying to push them every time we see one is sufficient to keep this
 // invariant.
 static Type *get_derived_type(Sema &sema, TypeKind kind, Type *type) {
-    Name *name = name_of_derived_type(sema.name_table, kind, type->name);
-    if (auto found = sema.type_table.find(name)) {
+    if (sema.shared_types) {
+        return sema.shared_types->get(kind, type);
+    }
+    DerivedTypeKey key{kind, type};
+    if (auto found = sema.type_table.find(key)) {
         return found->value;
     } else {
-        Type *derived = make_ref_type(sema, name, kind, type);
-        return *sema.type_table.insert(name, derived);
+        Type *derived = make_ref_type(sema, kind, type);
+        return *sema.type_table.insert(key, derived);
     }
 }
 
@@ -1100,8 +1199,7 @@ static void typecheck_unary_expr(Sema &sema, UnaryExpr *u) {
             return;
         }
         if (!is_pointer_type(u->operand->type)) {
-            error(u->loc, "dereferenced a non-pointer type '{}'",
-                  u->operand->type->name->text);
+            error(sema, u->pos, Diag::deref_non_pointer, u->operand->type);
             return;
         }
         u->type = u->operand->type->referee_type;
@@ -1132,7 +1230,7 @@ static void typecheck_unary_expr(Sema &sema, UnaryExpr *u) {
 
         // Prohibit taking address of an rvalue.
         if (!is_lvalue(u->operand)) {
-            error(u->loc, "cannot take address of an rvalue");
+            error(sema, u->pos, Diag::address_of_rvalue);
             return;
         }
 
@@ -1162,17 +1260,58 @@ static void typecheck_expr(Sema &sema, Expr *e) {
         auto de = static_cast<DeclRefExpr *>(e);
         auto sym = sema.decl_table.find(de->name);
         if (!sym) {
-            error(de->loc, "undeclared identifier '{}'", de->name->text);
+            error(sema, de->pos, Diag::undeclared_identifier, de->name->text);
+            record_missing(sema, de->name);
             return;
         }
         de->decl = sym->value;
         assert(de->decl);
+        record_use(sema, de->decl);
         de->type = de->decl->type;
         break;
     }
-    case ExprKind::call:
-        // TODO
+    case ExprKind::call: {
+        auto c = static_cast<CallExpr *>(e);
+        auto sym = sema.decl_table.find(c->func_name);
+        if (!sym) {
+            error(sema, c->pos, Diag::undeclared_function, c->func_name->text);
+            record_missing(sema, c->func_name);
+            return;
+        }
+        if (sym->value->kind != DeclKind::func) {
+            error(sema, c->pos, Diag::not_a_function, c->func_name->text);
+            return;
+        }
+        auto f = static_cast<FuncDecl *>(sym->value);
+        c->callee_decl = f;
+        record_use(sema, f);
+        if (f->body) {
+            sema.body_queue.push_back(f);
+        }
+
+        for (auto arg : c->args) {
+            typecheck_expr(sema, arg);
+        }
+        if (f->args_count() != c->args.size()) {
+            error(sema, c->pos, Diag::argument_count, c->func_name->text,
+                  f->args_count(), c->args.size());
+            return;
+        }
+        for (size_t i = 0; i < c->args.size(); i++) {
+            // don't propagate error
+            if (!c->args[i]->type || !f->args[i]->type) {
+                return;
+            }
+            if (!typecheck_assignable(f->args[i]->type, c->args[i]->type)) {
+                error(sema, c->args[i]->pos, Diag::argument_type, f->args[i]->type,
+                      c->args[i]->type);
+                return;
+            }
+        }
+
+        c->type = f->rettype;
         break;
+    }
     case ExprKind::struct_def: {
         auto sd = static_cast<StructDefExpr *>(e);
         typecheck_expr(sema, sd->name_expr);
@@ -1186,26 +1325,20 @@ static void typecheck_expr(Sema &sema, Expr *e) {
 
         Type *struct_type = sd->name_expr->decl->type;
         if (!struct_type) {
-            error(sd->name_expr->loc, "internal: typecheck not implemented");
+            error(sema, sd->name_expr->pos, Diag::not_implemented);
             return;
         }
         if (!is_struct_type(struct_type)) {
-            error(sd->name_expr->loc, "type '{}' is not a struct",
-                  struct_type->name->text);
+            error(sema, sd->name_expr->pos, Diag::not_a_struct, struct_type);
             return;
         }
         for (auto term : sd->terms) {
-            VarDecl *found_field_vardecl = nullptr;
-            for (auto field :
-                 static_cast<StructDecl *>(sd->name_expr->decl)->fields) {
-                if (term.name == field->name) {
-                    found_field_vardecl = field;
-                    break;
-                }
-            }
+            VarDecl *found_field_vardecl =
+                static_cast<StructDecl *>(sd->name_expr->decl)
+                    ->find_field(term.name);
             if (!found_field_vardecl) {
-                error(sd->loc, "unknown field '{}' in struct '{}'",
-                      term.name->text, struct_type->name->text);
+                error(sema, sd->pos, Diag::unknown_field, term.name->text,
+                      struct_type);
                 return;
             }
 
@@ -1216,9 +1349,8 @@ static void typecheck_expr(Sema &sema, Expr *e) {
             }
             if (!typecheck_assignable(found_field_vardecl->type,
                                       term.initexpr->type)) {
-                error(term.initexpr->loc, "cannot assign '{}' type to '{}'",
-                      term.initexpr->type->name->text,
-                      found_field_vardecl->type->name->text);
+                error(sema, term.initexpr->pos, Diag::assign_type,
+                      term.initexpr->type, found_field_vardecl->type);
                 return;
             }
         }
@@ -1237,22 +1369,19 @@ static void typecheck_expr(Sema &sema, Expr *e) {
 
         auto parent_type = mem->parent_expr->type;
         if (!is_struct_type(parent_type)) {
-            error(mem->parent_expr->loc, "type '{}' is not a struct",
-                  parent_type->name->text);
+            error(sema, mem->parent_expr->pos, Diag::not_a_struct, parent_type);
             return;
         }
 
-        VarDecl *found_field_vardecl = nullptr;
-        for (auto field :
-             static_cast<StructDecl *>(parent_type->type_decl)->fields) {
-            if (mem->member_name == field->name) {
-                found_field_vardecl = field;
-                break;
-            }
-        }
+        // The fields are part of the struct, which may not be named anywhere
+        // in this function.
+        record_use(sema, parent_type->type_decl);
+        VarDecl *found_field_vardecl =
+            static_cast<StructDecl *>(parent_type->type_decl)
+                ->find_field(mem->member_name);
         if (!found_field_vardecl) {
-            error(mem->loc, "unknown field '{}' in struct '{}'",
-                  mem->member_name->text, parent_type->name->text);
+            error(sema, mem->pos, Diag::unknown_field, mem->member_name->text,
+                  parent_type);
             return;
         }
 
@@ -1275,8 +1404,7 @@ static void typecheck_expr(Sema &sema, Expr *e) {
             return;
         }
         if (lhs_type != rhs_type) {
-            error(b->loc, "incompatible binary op with type '{}' and '{}'",
-                  lhs_type->name->text, rhs_type->name->text);
+            error(sema, b->pos, Diag::binary_op_type, lhs_type, rhs_type);
             return;
         }
         break;
@@ -1297,11 +1425,13 @@ static void typecheck_expr(Sema &sema, Expr *e) {
             // This is the very first point a new value type is encountered.
             auto sym = sema.decl_table.find(t->name);
             if (!sym) {
-                error(t->loc, "undefined type '{}'", t->name->text);
+                error(sema, t->pos, Diag::undefined_type, t->name->text);
+                record_missing(sema, t->name);
                 return;
             }
             t->decl = sym->value;
             assert(t->decl);
+            record_use(sema, t->decl);
 
             // Builtin types, or user types that have showed up before.
             t->type = t->decl->type;
@@ -1342,12 +1472,11 @@ static void typecheck_stmt(Sema &sema, Stmt *s) {
             return;
         }
         // if (!islvalue(as->lhs)) {
-        //     error(as->loc, "cannot assign to an rvalue");
+        //     error(sema, as->loc, "cannot assign to an rvalue");
         //     return;
         // }
         if (!typecheck_assignable(lhs_type, rhs_type)) {
-            error(as->loc, "cannot assign '{}' type to '{}'",
-                  rhs_type->name->text, lhs_type->name->text);
+            error(sema, as->pos, Diag::assign_type, rhs_type, lhs_type);
             return;
         }
 
@@ -1370,6 +1499,104 @@ static void typecheck_stmt(Sema &sema, Stmt *s) {
     }
 }
 
+// Toplevel declarations are checked in three passes, so that they can refer to
+// each other regardless of the order they appear in the file:
+//
+//   1. declare_decl() enters the names of all of them into the global scope,
+//      and creates the types of structs and enums.
+//   2. typecheck_signature() resolves the types of struct fields and function
+//      parameters and return values, which may name any global type.
+//   3. typecheck_body() checks function bodies, which may use any global
+//      declaration.
+//
+// Declarations local to a function run all three at once when they are
+// reached.
+
+static void declare_decl(Sema &sema, Decl *d) {
+    switch (d->kind) {
+    case DeclKind::func:
+        declare(sema, d->name, d);
+        break;
+    case DeclKind::struct_: {
+        auto s = static_cast<StructDecl *>(d);
+        declare(sema, s->name, s);
+        s->type = make_value_type(sema, s->name, s);
+        break;
+    }
+    case DeclKind::enum_: {
+        auto en = static_cast<EnumDecl *>(d);
+        declare(sema, en->name, en);
+        en->type = make_value_type(sema, en->name, en);
+        break;
+    }
+    case DeclKind::extern_:
+        declare_decl(sema, static_cast<ExternDecl *>(d)->decl);
+        break;
+    default:
+        assert(!"unknown decl kind");
+    }
+}
+
+static void typecheck_signature(Sema &sema, Decl *d) {
+    switch (d->kind) {
+    case DeclKind::func: {
+        auto f = static_cast<FuncDecl *>(d);
+        for (auto arg : f->args) {
+            typecheck_expr(sema, arg->type_expr);
+            arg->type = arg->type_expr->type;
+        }
+        if (f->rettypeexpr) {
+            typecheck_expr(sema, f->rettypeexpr);
+            f->rettype = f->rettypeexpr->type;
+        } else {
+            f->rettype = sema.context.void_type;
+        }
+        break;
+    }
+    case DeclKind::struct_: {
+        auto s = static_cast<StructDecl *>(d);
+        sema.decl_table.scope_open();
+        for (auto f : s->fields) {
+            typecheck_decl(sema, f);
+        }
+        sema.decl_table.scope_close();
+        s->build_field_index();
+        break;
+    }
+    case DeclKind::enum_:
+        // TODO: variants
+        break;
+    case DeclKind::extern_:
+        typecheck_signature(sema, static_cast<ExternDecl *>(d)->decl);
+        break;
+    default:
+        assert(!"unknown decl kind");
+    }
+}
+
+static void typecheck_body(Sema &sema, Decl *d) {
+    if (d->kind != DeclKind::func) {
+        return;
+    }
+    auto f = static_cast<FuncDecl *>(d);
+
+    sema.context.func_decl_stack.push_back(f);
+    sema.scope_open();
+    for (auto arg : f->args) {
+        declare(sema, arg->name, arg);
+    }
+    // The body is a scope of its own, so that its locals may shadow the
+    // parameters.
+    sema.scope_open();
+    for (auto body_stmt : f->body->stmts) {
+        typecheck_stmt(sema, body_stmt);
+    }
+    sema.scope_close();
+    sema.scope_close();
+    sema.context.func_decl_stack.pop_back();
+    f->body_checked = true;
+}
+
 static void typecheck_decl(Sema &sema, Decl *d) {
     switch (d->kind) {
     case DeclKind::var: {
@@ -1384,36 +1611,294 @@ static void typecheck_decl(Sema &sema, Decl *d) {
         }
         break;
     }
-    case DeclKind::func:
-        for (auto body_stmt : static_cast<FuncDecl *>(d)->body->stmts) {
-            typecheck_stmt(sema, body_stmt);
-        }
+    default:
+        declare_decl(sema, d);
+        typecheck_signature(sema, d);
+        typecheck_body(sema, d);
         break;
-    case DeclKind::struct_: {
-        auto s = static_cast<StructDecl *>(d);
-        declare(sema, s->name, s);
+    }
+}
 
-        s->type = make_value_type(sema, s->name, s);
+// What checking one function body produced.  Outcomes are merged back into the
+// main Sema in the order of the functions, whichever thread made them.
+struct BodyOutcome {
+    std::vector<Diagnostic> diags;
+    std::vector<FuncDecl *> callees;
+    std::vector<Decl *> used_globals;
+    std::vector<Name *> missing_globals;
+    // Wall time of the check, if timed.
+    double wall = 0;
+};
+
+static BodyOutcome typecheck_body_outcome(Sema &sema, FuncDecl *f) {
+    TRACE_SCOPE("typecheck", "body", f->name->text);
+    size_t diag_count = sema.diags.size();
+    std::optional<Stopwatch> watch;
+    if (sema.time_report) {
+        watch.emplace();
+    }
+    typecheck_body(sema, f);
+
+    BodyOutcome o;
+    o.wall = watch ? watch->wall() : 0;
+    o.diags.assign(sema.diags.list.begin() + diag_count, sema.diags.list.end());
+    sema.diags.list.resize(diag_count);
+    o.callees = std::move(sema.body_queue);
+    sema.body_queue.clear();
+    o.used_globals = std::move(sema.used_globals);
+    sema.used_globals.clear();
+    o.missing_globals = std::move(sema.missing_globals);
+    sema.missing_globals.clear();
+    return o;
+}
+
+// Check the bodies of `funcs` on `jobs` threads.
+//
+// Once the globals are declared and their signatures checked, a function body
+// only reads global state and writes to its own subtree.  Each thread gets its
+// own Sema holding the globals, so that the scopes opened in a body are private
+// to it.
+static std::vector<BodyOutcome>
+typecheck_bodies_parallel(Sema &sema, const std::vector<FuncDecl *> &funcs,
+                          unsigned jobs) {
+    while (sema.workers.size() < jobs) {
+        sema.workers.push_back(std::make_unique<SemaWorker>(sema));
+    }
+    if (!sema.threads || sema.threads->size() != jobs) {
+        sema.threads = std::make_unique<ThreadPool>(jobs);
+    }
 
-        sema.decl_table.scope_open();
-        for (auto f : s->fields) {
-            typecheck_decl(sema, f);
+    std::vector<BodyOutcome> outcomes(funcs.size());
+    sema.threads->parallel_for(funcs.size(), [&](unsigned w, size_t i) {
+        outcomes[i] = typecheck_body_outcome(sema.workers[w]->sema, funcs[i]);
+    });
+    return outcomes;
+}
+
+//
+// Query cache
+//
+
+static uint64_t text_hash(const Sema &sema, size_t pos, size_t endpos) {
+    return NameTable::hash({sema.source.buf.data() + pos, endpos - pos});
+}
+
+static uint64_t text_hash(const Sema &sema, const Decl *d) {
+    return text_hash(sema, d->pos, d->endpos);
+}
+
+// Hash of the part of a global declaration that other code can depend on.
+static uint64_t interface_hash(const Sema &sema, const Decl *d) {
+    if (d->kind == DeclKind::func) {
+        auto f = static_cast<const FuncDecl *>(d);
+        return text_hash(sema, f->pos, f->body ? f->body->pos : f->endpos);
+    }
+    return text_hash(sema, d);
+}
+
+// Return the global declaration named `text`, or nullptr if there is none.
+static Decl *find_global(Sema &sema, const std::string &text) {
+    auto sym = sema.decl_table.find(sema.name_table.get(text));
+    // Globals are only shadowed inside a body, and no body is open here.
+    if (!sym || sym->scope_level != 0) {
+        return nullptr;
+    }
+    return sym->value;
+}
+
+// Replay the cached result of checking the body of `f`, if its inputs are
+// unchanged.
+static bool replay_body(Sema &sema, FuncDecl *f, BodyOutcome &o) {
+    auto it = sema.cache->funcs.find(f->name->text);
+    if (it == sema.cache->funcs.end()) {
+        return false;
+    }
+    auto &result = it->second;
+    if (result.text_hash != text_hash(sema, f)) {
+        return false;
+    }
+    for (auto &[name, hash] : result.deps) {
+        auto d = find_global(sema, name);
+        if (!d || interface_hash(sema, d) != hash) {
+            return false;
         }
-        sema.decl_table.scope_close();
-        break;
     }
-    default:
-        assert(!"unknown decl kind");
+    for (auto &name : result.missing) {
+        if (find_global(sema, name)) {
+            return false;
+        }
     }
+    for (auto callee : result.callees) {
+        auto d = find_global(sema, callee);
+        if (!d || d->kind != DeclKind::func) {
+            return false;
+        }
+        o.callees.push_back(static_cast<FuncDecl *>(d));
+    }
+    // The arguments point into the cache entry, which is left alone for the
+    // rest of this compilation.
+    for (auto &saved : result.diags) {
+        Diagnostic d{saved.id, f->pos + saved.offset, {}};
+        for (size_t i = 0; i < saved.nargs; i++) {
+            d.args[i] = saved.args[i].c_str();
+        }
+        o.diags.push_back(d);
+    }
+    // The body itself is not walked, but as far as the later passes are
+    // concerned it has been checked.
+    f->body_checked = true;
+    return true;
 }
 
-void cmp::typecheck(Sema &sema, AstNode *n) {
+static void store_body(Sema &sema, FuncDecl *f, const BodyOutcome &o) {
+    auto &result = sema.cache->funcs[f->name->text];
+    uint64_t hash = text_hash(sema, f);
+    // The QBE text only depends on the text of the function.
+    if (result.text_hash != hash) {
+        result.has_qbe = false;
+        result.qbe.clear();
+    }
+    result.text_hash = hash;
+    result.deps.clear();
+    auto used = o.used_globals;
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    for (auto d : used) {
+        result.deps.push_back({d->name->text, interface_hash(sema, d)});
+    }
+    result.missing.clear();
+    auto missing = o.missing_globals;
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+    for (auto name : missing) {
+        result.missing.push_back(name->text);
+    }
+    result.diags.clear();
+    for (auto &d : o.diags) {
+        auto &saved = result.diags.emplace_back();
+        saved.id = d.id;
+        saved.offset = d.pos - f->pos;
+        for (auto &arg : d.args) {
+            if (arg.kind != DiagArg::none) {
+                saved.args[saved.nargs++] = arg.format();
+            }
+        }
+    }
+    result.callees.clear();
+    for (auto callee : o.callees) {
+        result.callees.push_back(callee->name->text);
+    }
+}
+
+// Check the bodies of `funcs`, reusing the results in the query cache where
+// possible.  Diagnostics are recorded and the called functions queued in the
+// order of `funcs`, so the result is the same regardless of `jobs` and of the
+// cache.
+static void typecheck_bodies(Sema &sema, const std::vector<FuncDecl *> &funcs,
+                             unsigned jobs) {
+    std::vector<BodyOutcome> outcomes(funcs.size());
+    std::vector<FuncDecl *> pending;
+    std::vector<size_t> pending_index;
+    for (size_t i = 0; i < funcs.size(); i++) {
+        if (sema.cache && replay_body(sema, funcs[i], outcomes[i])) {
+            sema.cache->stats.body_hits++;
+            continue;
+        }
+        pending.push_back(funcs[i]);
+        pending_index.push_back(i);
+    }
+
+    if (jobs > 1) {
+        auto checked = typecheck_bodies_parallel(sema, pending, jobs);
+        for (size_t i = 0; i < pending.size(); i++) {
+            outcomes[pending_index[i]] = std::move(checked[i]);
+        }
+    } else {
+        for (size_t i = 0; i < pending.size(); i++) {
+            outcomes[pending_index[i]] = typecheck_body_outcome(sema, pending[i]);
+        }
+    }
+    if (sema.cache) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            store_body(sema, pending[i], outcomes[pending_index[i]]);
+            sema.cache->stats.body_misses++;
+        }
+    }
+    if (sema.time_report) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            sema.time_report->add_func("typecheck", pending[i]->name->text,
+                                       outcomes[pending_index[i]].wall);
+        }
+    }
+
+    for (auto &o : outcomes) {
+        sema.diags.list.insert(sema.diags.list.end(), o.diags.begin(),
+                               o.diags.end());
+        if (sema.demand_driven) {
+            sema.body_queue.insert(sema.body_queue.end(), o.callees.begin(),
+                                   o.callees.end());
+        }
+    }
+}
+
+// Demand-driven checking of function bodies.  Starting from main, the bodies
+// are checked in waves: each wave checks the functions first called by the
+// previous one.  Functions that are never reached keep only the signature check.
+static void typecheck_reachable_bodies(Sema &sema, unsigned jobs) {
+    std::vector<FuncDecl *> wave;
+    auto main_sym = sema.decl_table.find(sema.name_table.get("main"));
+    if (main_sym && main_sym->value->kind == DeclKind::func) {
+        auto main_func = static_cast<FuncDecl *>(main_sym->value);
+        main_func->body_queued = true;
+        wave.push_back(main_func);
+    }
+
+    while (!wave.empty()) {
+        typecheck_bodies(sema, wave, jobs);
+
+        // Calls may have queued a function more than once.  Only the main
+        // thread reads and sets 'body_queued', between waves, which is why
+        // it is the one that dedups the queue.
+        wave.clear();
+        for (auto f : sema.body_queue) {
+            if (!f->body_queued) {
+                f->body_queued = true;
+                wave.push_back(f);
+            }
+        }
+        sema.body_queue.clear();
+    }
+}
+
+void cmp::typecheck(Sema &sema, AstNode *n, unsigned jobs) {
     switch (n->kind) {
-    case AstKind::file:
-        for (auto toplevel : static_cast<File *>(n)->toplevels) {
-            typecheck(sema, toplevel);
+    case AstKind::file: {
+        auto &toplevels = static_cast<File *>(n)->toplevels;
+        if (jobs > 1 && !sema.shared_types) {
+            // Signatures make derived types too, and these have to be the same
+            // ones that the workers see.
+            sema.concurrent_types = std::make_unique<ConcurrentTypeTable>();
+            sema.shared_types = sema.concurrent_types.get();
+        }
+        for (auto toplevel : toplevels) {
+            declare_decl(sema, static_cast<Decl *>(toplevel));
+        }
+        for (auto toplevel : toplevels) {
+            typecheck_signature(sema, static_cast<Decl *>(toplevel));
+        }
+        if (sema.demand_driven) {
+            typecheck_reachable_bodies(sema, jobs);
+        } else {
+            std::vector<FuncDecl *> funcs;
+            for (auto toplevel : toplevels) {
+                if (static_cast<Decl *>(toplevel)->kind == DeclKind::func) {
+                    funcs.push_back(static_cast<FuncDecl *>(toplevel));
+                }
+            }
+            typecheck_bodies(sema, funcs, jobs);
         }
         break;
+    }
     case AstKind::stmt:
         typecheck_stmt(sema, static_cast<Stmt *>(n));
         break;
@@ -1430,13 +1915,14 @@ static void codegen_decl(QbeGenerator &q, Decl *d);
 static void codegen_expr(QbeGenerator &q, Expr *e) {
     switch (e->kind) {
     case ExprKind::integer_literal:
-        q.emit_indent("%_{} =w add 0, {}\n", q.valstack.next_id,
-                     static_cast<IntegerLiteral *>(e)->value);
+        q.emit_indent(FMT_STRING("%_{} =w add 0, {}\n"), q.valstack.next_id,
+                      static_cast<IntegerLiteral *>(e)->value);
         q.valstack.push();
         break;
     case ExprKind::decl_ref:
-        q.emit_indent("%_{} =w add 0, %{}\n", q.valstack.next_id,
-                     static_cast<DeclRefExpr *>(e)->name->text);
+        q.emit_indent(FMT_STRING("%_{} =w add 0, %{}\n"),
+                      q.valstack.next_id,
+                      static_cast<DeclRefExpr *>(e)->name->text);
         q.valstack.push();
         break;
     case ExprKind::struct_def:
@@ -1466,8 +1952,9 @@ static void codegen_expr(QbeGenerator &q, Expr *e) {
         default:
             assert(!"unknown binary expr kind");
         }
-        q.emit_indent("%_{} =w {} %_{}, %_{}\n", q.valstack.next_id, op_str,
-                      q.valstack.pop(), q.valstack.pop());
+        q.emit_indent(FMT_STRING("%_{} =w {} %_{}, %_{}\n"),
+                      q.valstack.next_id, op_str, q.valstack.pop(),
+                      q.valstack.pop());
         q.valstack.push();
         break;
     }
@@ -1490,15 +1977,15 @@ static void codegen_stmt(QbeGenerator &q, Stmt *s) {
         // FIXME: hack, handle non-single-token LHS expr
         assert(as->lhs->kind == ExprKind::decl_ref);
         auto lhs_decl = static_cast<DeclRefExpr *>(as->lhs);
-        q.emit_indent("%{} =w add 0, %_{}\n", lhs_decl->name->text, q.valstack.pop());
+        q.emit_indent(FMT_STRING("%{} =w add 0, %_{}\n"), lhs_decl->name->text, q.valstack.pop());
         break;
     }
     case StmtKind::return_:
         codegen_expr(q, static_cast<ReturnStmt *>(s)->expr);
-        q.emit_indent("ret %_{}\n", q.valstack.pop());
+        q.emit_indent(FMT_STRING("ret %_{}\n"), q.valstack.pop());
         // This is here only to make QBE not complain.  In practice, no
         // instructions after this point should be reachable.
-        q.emit("@L{}\n", q.label_id);
+        q.emit(FMT_STRING("@L{}\n"), q.label_id);
         q.label_id++;
         break;
     case StmtKind::if_: {
@@ -1506,17 +1993,17 @@ static void codegen_stmt(QbeGenerator &q, Stmt *s) {
         auto id = q.ifelse_label_id;
         q.ifelse_label_id++;
         codegen_expr(q, if_stmt->cond);
-        q.emit_indent("jnz %_{}, @if_{}, @else_{}\n", q.valstack.pop(), id, id);
-        q.emit("@if_{}\n", id);
+        q.emit_indent(FMT_STRING("jnz %_{}, @if_{}, @else_{}\n"), q.valstack.pop(), id, id);
+        q.emit(FMT_STRING("@if_{}\n"), id);
         codegen_stmt(q, if_stmt->if_body);
-        q.emit_indent("jmp @fi_{}\n", id);
-        q.emit("@else_{}\n", id);
+        q.emit_indent(FMT_STRING("jmp @fi_{}\n"), id);
+        q.emit(FMT_STRING("@else_{}\n"), id);
         if (if_stmt->else_if) {
             codegen_stmt(q, if_stmt->else_if);
         } else if (if_stmt->else_body) {
             codegen_stmt(q, if_stmt->else_body);
         }
-        q.emit("@fi_{}\n", id);
+        q.emit(FMT_STRING("@fi_{}\n"), id);
         break;
     }
     case StmtKind::compound:
@@ -1535,7 +2022,7 @@ static void codegen_decl(QbeGenerator &q, Decl *d) {
         auto v = static_cast<VarDecl *>(d);
         if (v->assign_expr) {
             codegen_expr(q, v->assign_expr);
-            q.emit_indent("%{} =w add 0, %_{}\n", v->name->text, q.valstack.pop());
+            q.emit_indent(FMT_STRING("%{} =w add 0, %_{}\n"), v->name->text, q.valstack.pop());
         }
         break;
     }
@@ -1546,28 +2033,116 @@ static void codegen_decl(QbeGenerator &q, Decl *d) {
         // Analyses in the earlier passes should make sure that this ret is not
         // reachable.  This is only here to make QBE work meanwhile those
         // analyses are not fully implemented yet.
-        q.emit_indent("ret\n");
+        q.emit_indent(FMT_STRING("ret\n"));
         break;
-    case DeclKind::struct_: {
+    case DeclKind::struct_:
+    case DeclKind::enum_:
+    case DeclKind::extern_:
         break;
-    }
     default:
         assert(!"unknown decl kind");
     }
 }
 
+// Emit `f` as a QBE function of its own.  Temporaries and labels are numbered
+// per function, so the text only depends on the function itself.
+static void codegen_func(QbeGenerator &q, FuncDecl *f) {
+    q.valstack = ValStack{};
+    q.label_id = 0;
+    q.ifelse_label_id = 0;
+
+    bool is_main = strcmp(f->name->text, "main") == 0;
+    q.emit(FMT_STRING("{}function w ${}("), is_main ? "export " : "",
+           f->name->text);
+    for (size_t i = 0; i < f->args.size(); i++) {
+        q.emit(FMT_STRING("{}w %{}"), i == 0 ? "" : ", ",
+               f->args[i]->name->text);
+    }
+    q.emit(FMT_STRING(") {{\n"));
+    q.emit(FMT_STRING("@start\n"));
+    {
+        QbeGenerator::IndentBlock ib{q};
+        codegen_decl(q, f);
+    }
+    q.emit(FMT_STRING("}}\n"));
+}
+
+// Emit `f` and return a copy of its QBE text, for the caches.
+static std::string codegen_func_text(QbeGenerator &q, FuncDecl *f) {
+    size_t start = q.out.size();
+    codegen_func(q, f);
+    return std::string{q.text().substr(start)};
+}
+
+// Emit `f`, or its text from the query cache or the disk cache if the function
+// is unchanged.
+static void codegen_func_cached(QbeGenerator &q, FuncDecl *f) {
+    auto cache = q.sema.cache;
+    if (!cache && !q.disk_cache) {
+        codegen_func(q, f);
+        return;
+    }
+
+    QueryCache::FuncResult *result = nullptr;
+    uint64_t hash = text_hash(q.sema, f);
+    if (cache) {
+        result = &cache->funcs[f->name->text];
+        if (result->has_qbe && result->text_hash == hash) {
+            cache->stats.qbe_hits++;
+            q.emit_text(result->qbe);
+            return;
+        }
+    }
+
+    std::string text;
+    if (q.disk_cache) {
+        // Codegen only looks at the function itself, so its text is the key.
+        CacheKey key;
+        key.add({q.sema.source.buf.data() + f->pos, f->endpos - f->pos});
+        if (q.disk_cache->get(key, "func", text)) {
+            q.disk_cache->funcs.hits++;
+            q.emit_text(text);
+        } else {
+            text = codegen_func_text(q, f);
+            q.disk_cache->put(key, "func", text);
+            q.disk_cache->funcs.misses++;
+        }
+    } else {
+        text = codegen_func_text(q, f);
+    }
+
+    if (result) {
+        result->text_hash = hash;
+        result->has_qbe = true;
+        result->qbe = text;
+        cache->stats.qbe_misses++;
+    }
+}
+
 void cmp::codegen(QbeGenerator &q, AstNode *n) {
     switch (n->kind) {
-    case AstKind::file: {
-        q.emit("export function w $main() {{\n");
-        q.emit("@start\n");
-        QbeGenerator::IndentBlock ib{q};
+    case AstKind::file:
         for (auto toplevel : static_cast<File *>(n)->toplevels) {
-            codegen(q, toplevel);
+            auto d = static_cast<Decl *>(toplevel);
+            // Skip functions that demand-driven typecheck found to be
+            // unreachable.
+            if (d->kind != DeclKind::func ||
+                !static_cast<FuncDecl *>(d)->body_checked) {
+                continue;
+            }
+            auto f = static_cast<FuncDecl *>(d);
+            TRACE_SCOPE("codegen", "function", f->name->text);
+            std::optional<Stopwatch> watch;
+            if (q.sema.time_report) {
+                watch.emplace();
+            }
+            codegen_func_cached(q, f);
+            if (watch) {
+                q.sema.time_report->add_func("codegen", f->name->text,
+                                             watch->wall());
+            }
         }
-        q.emit("}}\n");
         break;
-    }
     case AstKind::stmt:
         codegen_stmt(q, static_cast<Stmt *>(n));
         break;
@@ -2,10 +2,23 @@
 #define CMP_SEMA_H
 
 #include "ast_visitor.h"
+#include "diagnostic.h"
 #include "error.h"
+// The bundled fmt/compile.h declares typedefs that it does not use.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-local-typedefs"
+#include "fmt/compile.h"
+#pragma GCC diagnostic pop
 #include "fmt/core.h"
+#include "pool.h"
 #include "scoped_table.h"
+#include "shadow_table.h"
+#include "time_report.h"
+#include <algorithm>
+#include <array>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <utility>
 
 namespace cmp {
@@ -54,7 +67,45 @@ struct BasicBlock {
     void enumerate_postorder(std::vector<BasicBlock *> &walkList);
 };
 
+// Structural key of a derived type, e.g. '*T' is {ref, T}.  Mutability of
+// references is part of the kind.
+struct DerivedTypeKey {
+    TypeKind kind;
+    Type *referee;
+
+    bool operator==(const DerivedTypeKey &o) const {
+        return kind == o.kind && referee == o.referee;
+    }
+};
+
+struct DerivedTypeKeyHash {
+    uint64_t operator()(const DerivedTypeKey &key) const {
+        return hash_combine(hash(key.referee), static_cast<uint64_t>(key.kind));
+    }
+};
+
+// Thread-safe interner of derived types.  When function bodies are checked in
+// parallel, the Semas of all threads share one of these, so that each derived
+// type still exists only once.
+class ConcurrentTypeTable {
+public:
+    // Get or make the derived type of `kind` that refers to `referee`.
+    Type *get(TypeKind kind, Type *referee);
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        ScopedTable<DerivedTypeKey, Type *, DerivedTypeKeyHash> table;
+        SlabPool<Type> type_pool;
+    };
+    std::array<Shard, 16> shards;
+};
+
 class Parser;
+struct SemaWorker;
+class ThreadPool;
+struct QueryCache;
+struct DiskCache;
 
 class Lifetime {
 public:
@@ -74,24 +125,64 @@ public:
     Lifetime(Name *a) : kind(annotated), lifetime_annot(a) {}
 };
 
+// Names and declarations that every compilation starts with: the keywords and
+// the builtin types.  It is made once and then only read, so that the Semas of
+// many compilations can share it, e.g. in a compile server.
+struct Prelude {
+    NameTable name_table;
+    std::vector<std::unique_ptr<AstNode>> node_pool;
+    SlabPool<Type> type_pool;
+    // Builtin types.
+    Context context;
+    // Declarations of the builtin types.
+    std::vector<Decl *> decls;
+
+    Prelude();
+    Prelude(const Prelude &) = delete;
+};
+
+// Memory of a Sema that outlives it, so that the next Sema of a batch reuses it
+// instead of allocating anew.  The Sema borrows the arena while it lives, and
+// gives it back emptied.
+struct SemaArena {
+    const Prelude *prelude;
+    NameTable name_table;
+    std::vector<std::unique_ptr<AstNode>> node_pool;
+    SlabPool<Type> type_pool;
+    SlabPool<Lifetime> lifetime_pool;
+    SlabPool<BasicBlock> basic_block_pool;
+
+    SemaArena(const Prelude *p)
+        : prelude(p), name_table(p ? &p->name_table : nullptr) {}
+};
+
 // Stores all of the semantic information necessary for semantic analysis
 // phase.
 struct Sema {
     const Source &source; // source text
+    // Shared names and builtins that this Sema builds on, if any.
+    const Prelude *prelude = nullptr;
     NameTable name_table; // name table
 
-    // Memory pools.  Currently maintains simply a list of malloc()ed pointers
-    // for batch freeing.
+    // Memory pools.  AST nodes are simply a list of malloc()ed pointers for
+    // batch freeing.  The rest are typed slabs, which all live as long as
+    // Sema.
     std::vector<std::unique_ptr<AstNode>> node_pool;
-    std::vector<Type *> type_pool;
-    std::vector<Lifetime *> lifetime_pool;
-    std::vector<BasicBlock *> basic_block_pool;
+    SlabPool<Type> type_pool;
+    SlabPool<Lifetime> lifetime_pool;
+    SlabPool<BasicBlock> basic_block_pool;
 
     // Declarations visible at the current scope, keyed by their Names.
-    ScopedTable<Name *, Decl *> decl_table;
+    // ShadowTable makes each lookup a single load; ScopedTable<Name *, Decl *>
+    // is a drop-in hash-based alternative.
+    ShadowTable<Decl *> decl_table;
 
-    // XXX: needed?
-    ScopedTable<Name *, Type *> type_table;
+    // Derived types interned by their structure, so that each of them exists
+    // only once and can be compared by pointer.  Types outlive scopes, so this
+    // table is never scope-opened.
+    ScopedTable<DerivedTypeKey, Type *, DerivedTypeKeyHash> type_table;
+    // Used in place of type_table if not null.
+    ConcurrentTypeTable *shared_types = nullptr;
 
     // Stores lifetimes that are alive at the current position.
     // Note that this variable is not meant to be used directly; use
@@ -104,16 +195,42 @@ struct Sema {
     // TODO: organize.
     Context context;
 
-    // List of generated errors.
-    std::vector<Error> &errors;
+    // Diagnostics found so far.
+    Diagnostics &diags;
     // List of error beacons found in the source text.
     std::vector<Error> &beacons;
 
-    Sema(const Source &s, std::vector<Error> &e, std::vector<Error> &b)
-        : source(s), errors(e), beacons(b) {}
+    // Whether to typecheck only the function bodies reachable from main.
+    bool demand_driven = false;
+    // Functions called from the bodies checked so far.  In demand-driven mode,
+    // these are checked in the next wave.  May contain duplicates.
+    std::vector<FuncDecl *> body_queue;
+    // Globals used by the body being checked.  May contain duplicates.
+    std::vector<Decl *> used_globals;
+    // Names that the body being checked looked up and found undeclared, which
+    // it depends on not being declared.  May contain duplicates.
+    std::vector<Name *> missing_globals;
+    // Results of earlier compilations of the same file, if any.
+    QueryCache *cache = nullptr;
+    // Where to record the time spent on each function, if anywhere.
+    TimeReport *time_report = nullptr;
+
+    // Where the pools came from, if not allocated by this Sema.
+    SemaArena *arena = nullptr;
+
+    // State of the threads of a parallel typecheck.  The workers own the nodes
+    // and types they made while checking function bodies, so they live as long
+    // as this Sema.  The threads themselves are kept across the waves of a
+    // demand-driven typecheck.
+    std::unique_ptr<ConcurrentTypeTable> concurrent_types;
+    std::vector<std::unique_ptr<SemaWorker>> workers;
+    std::unique_ptr<ThreadPool> threads;
+
+    Sema(const Source &s, Diagnostics &d, std::vector<Error> &b,
+         const Prelude *p = nullptr, SemaArena *arena = nullptr);
+    ~Sema();
     Sema(const Sema &) = delete;
     Sema(Sema &&) = delete;
-    ~Sema();
 
     void scope_open();
     void scope_close();
@@ -139,14 +256,19 @@ struct Sema {
         return node;
     }
     template <typename... Args> Lifetime *make_lifetime(Args &&...args) {
-        lifetime_pool.emplace_back(new Lifetime{std::forward<Args>(args)...});
-        return lifetime_pool.back();
-    }
-    BasicBlock *makeBasicBlock() {
-        BasicBlock *bb = new BasicBlock;
-        basic_block_pool.push_back(bb);
-        return bb;
+        return lifetime_pool.make(std::forward<Args>(args)...);
     }
+    BasicBlock *makeBasicBlock() { return basic_block_pool.make(); }
+};
+
+// Sema of a thread that checks function bodies in parallel.  It starts with the
+// global declarations and builtin types of its parent, and shares the parent's
+// derived types.
+struct SemaWorker {
+    Diagnostics diags;
+    Sema sema;
+
+    SemaWorker(Sema &parent);
 };
 
 void setup_builtin_types(Sema &s);
@@ -161,7 +283,7 @@ class NameBinding : public AstVisitor<NameBinding> {
 
 public:
     NameBinding(Sema &s) : sema{s} {}
-    bool success() const { return sema.errors.empty(); }
+    bool success() const { return sema.diags.empty(); }
 
     void visitCompoundStmt(CompoundStmt *cs);
     void visitDeclRefExpr(DeclRefExpr *d);
@@ -174,7 +296,8 @@ public:
     void visitEnumDecl(EnumDecl *e);
 };
 
-void typecheck(Sema &sema, AstNode *n);
+// Typecheck `n`.  For a File, function bodies are checked on `jobs` threads.
+void typecheck(Sema &sema, AstNode *n, unsigned jobs = 1);
 
 // Type checking pass.
 class TypeChecker : public AstVisitor<TypeChecker, Type *> {
@@ -182,7 +305,7 @@ class TypeChecker : public AstVisitor<TypeChecker, Type *> {
 
 public:
     TypeChecker(Sema &s) : sema{s} {}
-    bool success() const { return sema.errors.empty(); }
+    bool success() const { return sema.diags.empty(); }
 
     Type *visitAssignStmt(AssignStmt *as);
     Type *visitReturnStmt(ReturnStmt *rs);
@@ -211,7 +334,7 @@ class ReturnChecker
 
 public:
     ReturnChecker(Sema &s) : sema{s} {}
-    bool success() const { return sema.errors.empty(); }
+    bool success() const { return sema.diags.empty(); }
 
     BasicBlock *visitStmt(Stmt *s, BasicBlock *bb);
     BasicBlock *visitCompoundStmt(CompoundStmt *cs, BasicBlock *bb);
@@ -245,21 +368,34 @@ struct QbeGenerator {
     int label_id = 0;
     int ifelse_label_id = 0;
     int indent = 0;
-    FILE *file;
-
-    QbeGenerator(Sema &s, const char *filename) : sema{s} {
-        file = fopen(filename, "w");
-    }
-    ~QbeGenerator() {
-        fclose(file);
+    // The QBE text of the whole file, to be written out in one go.
+    fmt::memory_buffer out;
+    // Where to look up and store the QBE text of each function, if anywhere.
+    DiskCache *disk_cache = nullptr;
+
+    QbeGenerator(Sema &s) : sema{s} {}
+
+    // `format_str` must be a FMT_STRING, so that it is parsed at compile time.
+    template <typename S, typename... Args>
+    void emit_indent(S format_str, const Args &...args) {
+        ALLOC_SCOPE(fmt);
+        out.resize(out.size() + indent);
+        std::fill(out.end() - indent, out.end(), ' ');
+        fmt::format_to(std::back_inserter(out),
+                       fmt::compile<Args...>(format_str), args...);
     }
-    template <typename... Args> void emit_indent(Args &&...args) {
-        fmt::print(file, "{:{}}", "", indent);
-        fmt::print(file, std::forward<Args>(args)...);
+    template <typename S, typename... Args>
+    void emit(S format_str, const Args &...args) {
+        ALLOC_SCOPE(fmt);
+        fmt::format_to(std::back_inserter(out),
+                       fmt::compile<Args...>(format_str), args...);
     }
-    template <typename... Args> void emit(Args &&...args) {
-        fmt::print(file, std::forward<Args>(args)...);
+    // Emit text that is already formatted.
+    void emit_text(std::string_view text) {
+        ALLOC_SCOPE(fmt);
+        out.append(text.data(), text.data() + text.size());
     }
+    std::string_view text() const { return {out.data(), out.size()}; }
     struct IndentBlock {
         QbeGenerator &c;
         IndentBlock(QbeGenerator &c) : c{c} { c.indent += 4; }
@@ -0,0 +1,341 @@
+#include "server.h"
+#include "fmt/core.h"
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace cmp {
+
+namespace {
+
+// A request is a 4-byte length, sent along with the stdin, stdout and stderr
+// of the client, followed by that many bytes of NUL-terminated strings: the
+// working directory of the client, then its arguments.  The reply is the
+// 4-byte exit status.
+constexpr int PASSED_FDS = 3;
+
+bool write_all(int fd, const void *buf, size_t len) {
+    auto p = static_cast<const char *>(buf);
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *buf, size_t len) {
+    auto p = static_cast<char *>(buf);
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool make_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fmt::print(stderr, "error: socket path '{}' is too long\n", path);
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Return a socket connected to the server on `path`, or -1.
+int connect_to(const std::string &path) {
+    sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Whether the process on the other end of `fd` runs as the same user.  The
+// client hands its standard streams and working directory to the server, and
+// the server runs whatever the client asks for, so neither talks to anyone
+// else.
+bool peer_is_us(int fd) {
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           cred.uid == getuid();
+}
+
+// Written to by the SIGCHLD handler, to wake up the server loop.
+int child_pipe[2];
+
+void on_sigchld(int) {
+    int saved = errno;
+    [[maybe_unused]] auto n = write(child_pipe[1], "", 1);
+    errno = saved;
+}
+
+// Receive the request on `conn`, and run it with the standard streams and
+// working directory of the client.  Runs in the forked child.
+[[noreturn]] void
+handle_request(int conn, const std::function<int(int, char **)> &handle) {
+    uint32_t len;
+    iovec iov{&len, sizeof(len)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * PASSED_FDS)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(len)) {
+        _exit(EXIT_FAILURE);
+    }
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * PASSED_FDS)) {
+        _exit(EXIT_FAILURE);
+    }
+    int fds[PASSED_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    std::vector<char> payload(len);
+    if (!read_all(conn, payload.data(), len) || payload.empty() ||
+        payload.back() != '\0') {
+        _exit(EXIT_FAILURE);
+    }
+    close(conn);
+    std::vector<char *> args;
+    for (size_t i = 0; i < payload.size(); i += strlen(&payload[i]) + 1) {
+        args.push_back(&payload[i]);
+    }
+    args.push_back(nullptr);
+
+    for (int i = 0; i < PASSED_FDS; i++) {
+        dup2(fds[i], i);
+        if (fds[i] != i) {
+            close(fds[i]);
+        }
+    }
+    if (chdir(args[0]) != 0) {
+        fmt::print(stderr, "error: cannot change directory to '{}'\n", args[0]);
+        exit(EXIT_FAILURE);
+    }
+    // exit() rather than _exit(), so that stdio is flushed.
+    exit(handle(args.size() - 2, args.data() + 1));
+}
+
+} // namespace
+
+std::string default_socket_path() {
+    if (auto dir = getenv("XDG_RUNTIME_DIR"); dir && *dir) {
+        return std::string{dir} + "/ruse.sock";
+    }
+    // /tmp is shared, so the socket goes in a directory that only we can
+    // enter.  Someone else may have made it first, in which case it is not
+    // used.
+    auto dir = fmt::format("/tmp/ruse-{}", getuid());
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        fmt::print(stderr, "error: cannot create '{}': {}\n", dir,
+                   strerror(errno));
+        return {};
+    }
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 0077) != 0) {
+        fmt::print(stderr, "error: '{}' is not a private directory\n", dir);
+        return {};
+    }
+    return dir + "/ruse.sock";
+}
+
+int serve(const std::string &socket_path,
+          const std::function<int(int argc, char **argv)> &handle) {
+    sockaddr_un addr;
+    if (!make_address(socket_path, addr)) {
+        return EXIT_FAILURE;
+    }
+    // A leftover socket file is reused, but not the socket of a live server,
+    // and nothing that is not our own socket.
+    if (int fd = connect_to(socket_path); fd >= 0) {
+        close(fd);
+        fmt::print(stderr, "error: a server is already listening on '{}'\n",
+                   socket_path);
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            fmt::print(stderr, "error: '{}' exists and is not our socket\n",
+                       socket_path);
+            return EXIT_FAILURE;
+        }
+        unlink(socket_path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fmt::print(stderr, "error: cannot listen on '{}': {}\n", socket_path,
+                   strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (pipe2(child_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fmt::print(stderr, "error: pipe: {}\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct sigaction sa {};
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, nullptr);
+    fmt::print(stderr, "ruse: serving on {}\n", socket_path);
+
+    // Connections of the requests in flight, by the pid of their child.
+    std::unordered_map<pid_t, int> clients;
+    while (true) {
+        pollfd pfds[] = {{listener, POLLIN, 0}, {child_pipe[0], POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fmt::print(stderr, "error: poll: {}\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(child_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                auto it = clients.find(pid);
+                if (it == clients.end()) {
+                    continue;
+                }
+                // Same as a shell would report.
+                int32_t code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                                 : 128 + WTERMSIG(status);
+                write_all(it->second, &code, sizeof(code));
+                close(it->second);
+                clients.erase(it);
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) {
+                continue;
+            }
+            if (!peer_is_us(conn)) {
+                close(conn);
+                continue;
+            }
+            fflush(nullptr);
+            pid_t pid = fork();
+            if (pid == 0) {
+                signal(SIGCHLD, SIG_DFL);
+                close(listener);
+                close(child_pipe[0]);
+                close(child_pipe[1]);
+                for (auto [_, fd] : clients) {
+                    close(fd);
+                }
+                handle_request(conn, handle);
+            }
+            if (pid < 0) {
+                fmt::print(stderr, "error: fork: {}\n", strerror(errno));
+                close(conn);
+                continue;
+            }
+            clients[pid] = conn;
+        }
+    }
+}
+
+int request(const std::string &socket_path, int argc, char **argv) {
+    int fd = connect_to(socket_path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!peer_is_us(fd)) {
+        fmt::print(stderr,
+                   "error: the server on '{}' is run by another user\n",
+                   socket_path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        fmt::print(stderr, "error: getcwd: {}\n", strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    std::string payload{cwd};
+    payload.push_back('\0');
+    for (int i = 0; i < argc; i++) {
+        payload += argv[i];
+        payload.push_back('\0');
+    }
+
+    uint32_t len = payload.size();
+    iovec iov{&len, sizeof(len)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * PASSED_FDS)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * PASSED_FDS);
+    int fds[PASSED_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t code;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len) ||
+        !write_all(fd, payload.data(), payload.size()) ||
+        !read_all(fd, &code, sizeof(code))) {
+        fmt::print(stderr, "error: lost connection to the server on '{}'\n",
+                   socket_path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    return code;
+}
+
+} // namespace cmp
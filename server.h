@@ -0,0 +1,36 @@
+// -*- C++ -*-
+#ifndef CMP_SERVER_H
+#define CMP_SERVER_H
+
+#include <functional>
+#include <string>
+
+namespace cmp {
+
+// Compile server.  The server starts once, sets up the state that every
+// compilation needs, and then serves compile requests over a Unix domain
+// socket, each in a child process forked off the warm server.  The child
+// inherits that state, gets the working directory, arguments and standard
+// streams of the client, and is discarded when done.  This keeps requests
+// fully isolated from each other, and gives back all of their memory.
+
+// $XDG_RUNTIME_DIR/ruse.sock, or ruse.sock in the private directory
+// /tmp/ruse-<uid>, which is made if needed.  Returns an empty string if that
+// directory cannot be made or is not private.
+std::string default_socket_path();
+
+// Serve requests on `socket_path` until killed.  Each request is handled by
+// calling `handle` with the arguments of the client in a child process, and
+// its return value is sent back to the client as the exit status.  Only
+// clients of the same user are served.  Returns only on an error.
+int serve(const std::string &socket_path,
+          const std::function<int(int argc, char **argv)> &handle);
+
+// Send `argv` to the server on `socket_path` and wait for it to finish.
+// Return its exit status, or -1 if no server is listening there.  Requests
+// are only sent to a server of the same user.
+int request(const std::string &socket_path, int argc, char **argv);
+
+} // namespace cmp
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef CMP_SHADOW_TABLE_H
+#define CMP_SHADOW_TABLE_H
+
+#include "pool.h"
+#include "types.h"
+#include <vector>
+
+namespace cmp {
+
+// Scoped symbol table keyed by Name, in the style of classic compiler symbol
+// tables.
+//
+// Since Names are already unique interned objects, there is no need to hash
+// them.  Every Name instead owns a stack of its bindings, innermost first, and
+// the top of that stack is found by indexing 'heads' with the Name's id.  A
+// lookup is therefore a single load, and closing a scope pops exactly the
+// bindings made in it.
+//
+// The stack heads are kept in the table rather than on the Name itself, so
+// that more than one table (e.g. one per thread) can bind the same Names
+// independently.
+//
+// The interface mirrors ScopedTable, so the two are interchangeable.
+template <typename T> struct ShadowTable {
+    struct Symbol {
+        Name *const key;            // name of this symbol
+        T value;                    // semantic value of this symbol (owned)
+        Symbol *shadowed = nullptr; // outer binding of the same name
+        Symbol *cross = nullptr;    // next symbol in the same scope
+        int scope_level = 0;
+
+        Symbol(Name *k, const T &v) : key(k), value(v) {}
+    };
+
+    ShadowTable() {
+        scope_stack.reserve(64);
+        scope_stack.push_back({nullptr, symbol_pool.mark()});
+    }
+
+    // Insert symbol at the current scope level.
+    T *insert(Name *key, const T &value) {
+        if (key->id >= heads.size()) {
+            heads.resize(key->id + 1, nullptr);
+        }
+
+        Symbol *head = symbol_pool.make(key, value);
+        head->shadowed = heads[key->id];
+        heads[key->id] = head;
+
+        head->cross = scope_stack.back().head;
+        head->scope_level = curr_scope_level;
+        scope_stack.back().head = head;
+
+        live_count++;
+        if (live_count > peak_count) {
+            peak_count = live_count;
+        }
+        return &head->value;
+    }
+
+    // Note that `find(nullptr)` always returns nullptr.
+    Symbol *find(const Name *key) const {
+        if (!key || key->id >= heads.size()) {
+            return nullptr;
+        }
+        return heads[key->id];
+    }
+
+    // Start a new scope.
+    void scope_open() {
+        scope_stack.push_back({nullptr, symbol_pool.mark()});
+        curr_scope_level++;
+    }
+
+    // Close current scope.
+    void scope_close() {
+        for (Symbol *p = scope_stack.back().head; p; p = p->cross) {
+            heads[p->key->id] = p->shadowed;
+            live_count--;
+        }
+        symbol_pool.rewind(scope_stack.back().mark);
+        scope_stack.pop_back();
+        curr_scope_level--;
+    }
+
+    // Innermost binding of each Name, indexed by Name::id.
+    std::vector<Symbol *> heads;
+    struct Scope {
+        Symbol *head;
+        typename SlabPool<Symbol>::Mark mark;
+    };
+    std::vector<Scope> scope_stack;
+    int curr_scope_level = 0;
+    SlabPool<Symbol> symbol_pool;
+
+    // Number of symbols currently in the table, and its high-water mark.
+    size_t live_count = 0;
+    size_t peak_count = 0;
+};
+
+} // namespace cmp
+
+#endif
@@ -1,4 +1,6 @@
 #include "source.h"
+#include "alloc_profile.h"
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <sstream>
@@ -36,14 +38,14 @@ void Source::init(std::istream &in) {
     buf.push_back('\0');
 }
 
-// TODO: perf shows this is the main bottleneck.
 SourceLoc Source::locate(size_t pos) const {
-    // Search linearly for the current line.
-    int line;
-    for (line = 0; static_cast<size_t>(line) < line_off.size(); line++) {
-        if (pos < line_off[line])
-            break;
-    }
+    // The filename is copied into every SourceLoc.
+    ALLOC_SCOPE(source_loc);
+    // Binary search for the first line that starts after 'pos'.  Every node
+    // is located when it is made, so a linear search here makes parsing
+    // quadratic in the number of lines.
+    int line = std::upper_bound(line_off.begin(), line_off.end(), pos) -
+               line_off.begin();
     int col = pos - line_off[line - 1] + 1;
     return SourceLoc{filename, line, col};
 }
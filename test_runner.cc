@@ -0,0 +1,259 @@
+// Runs the test programs in test/.
+//
+// Usage: ruse-test [-jN] [-v] [dir-or-file...]
+//
+// Every file is compiled in this process, on N threads, and only the
+// executables it produces are spawned.  The first line of a file says what to
+// expect:
+//
+//   // fail      compilation fails, with exactly the errors marked by beacons
+//   // exit N    the program compiles and exits with N
+//   // skip ...  the file is not run
+//
+// Anything else is the same as "// exit 0".  A second line of
+//
+//   // after FILE
+//
+// makes the file an edit of FILE, in the same directory: FILE is compiled
+// first, and this file then reuses its results as in -fwatch.  If QBE is not
+// installed, the programs are only typechecked.
+
+#include "driver.h"
+#include "fmt/core.h"
+#include "parallel.h"
+#include "query.h"
+#include "sema.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char **environ;
+
+using namespace cmp;
+
+namespace {
+
+enum class Outcome { pass, fail, skip };
+
+struct Expectation {
+    bool skip = false;
+    bool fail = false;
+    int exit_code = 0;
+    // The file this is an edit of, if any.
+    std::string after;
+};
+
+Expectation read_header(const Source &source) {
+    Expectation e;
+    std::string_view text{source.buf.data(), source.buf.size()};
+    auto end = text.find('\n');
+    auto line = text.substr(0, end);
+    if (line.substr(0, 7) == "// skip") {
+        e.skip = true;
+    } else if (line.substr(0, 7) == "// fail") {
+        e.fail = true;
+    } else if (line.substr(0, 8) == "// exit ") {
+        e.exit_code = atoi(std::string{line.substr(8)}.c_str());
+    }
+    if (end != std::string_view::npos) {
+        auto next = text.substr(end + 1);
+        next = next.substr(0, next.find('\n'));
+        if (next.substr(0, 9) == "// after ") {
+            e.after = next.substr(9);
+        }
+    }
+    return e;
+}
+
+// Run `path` with its output discarded, and return its exit status, or -1 if
+// it did not exit normally.
+int run_program(const std::string &path) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    pid_t pid;
+    char *argv[] = {const_cast<char *>(path.c_str()), nullptr};
+    int err = posix_spawn(&pid, path.c_str(), &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Append the .ruse files under `path` in name order, or `path` itself if it
+// is a file.
+void collect(const std::string &path, std::vector<std::string> &files) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        files.push_back(path);
+        return;
+    }
+    std::vector<std::string> names;
+    while (auto ent = readdir(dir)) {
+        std::string_view name{ent->d_name};
+        if (name.size() > 5 && name.substr(name.size() - 5) == ".ruse") {
+            names.push_back(path + "/" + ent->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    files.insert(files.end(), names.begin(), names.end());
+}
+
+struct Runner {
+    const Prelude &prelude;
+    // Build and run the programs, or only typecheck them.
+    bool run = true;
+    // Scratch directory for the outputs.
+    std::string tmpdir;
+    // Keeps the output of different tests apart.
+    std::mutex output_mutex;
+
+    Runner(const Prelude &prelude) : prelude{prelude} {}
+
+    Outcome test(const std::string &file, size_t index, SemaArena &arena,
+                 std::string &why);
+};
+
+Outcome Runner::test(const std::string &file, size_t index, SemaArena &arena,
+                     std::string &why) {
+    Options opts;
+    opts.output = fmt::format("{}/{}", tmpdir, index);
+    Driver d{Path{file}, opts};
+    d.prelude = &prelude;
+    d.arena = &arena;
+    auto expect = read_header(d.source);
+    if (expect.skip) {
+        return Outcome::skip;
+    }
+    QueryCache cache;
+    if (!expect.after.empty()) {
+        // The earlier version only has to be checked, and may have errors.
+        auto dir = file.substr(0, file.rfind('/') + 1);
+        Options before_opts;
+        before_opts.verify = true;
+        Driver before{Path{dir + expect.after}, before_opts};
+        before.prelude = &prelude;
+        before.arena = &arena;
+        before.cache = &cache;
+        before.compile();
+        d.cache = &cache;
+    }
+
+    // Programs that are not run only need to be checked against their
+    // beacons, and that only needs the front end.
+    d.opts.verify = expect.fail || !run;
+    bool compiled = d.compile();
+    if (expect.fail) {
+        if (compiled) {
+            why = "compiled without errors";
+            return Outcome::fail;
+        }
+        std::lock_guard lock{output_mutex};
+        if (!d.verify()) {
+            why = "errors do not match";
+            return Outcome::fail;
+        }
+        return Outcome::pass;
+    }
+    if (!compiled) {
+        if (d.opts.verify) {
+            std::lock_guard lock{output_mutex};
+            d.report();
+        }
+        why = "compilation failed";
+        return Outcome::fail;
+    }
+    if (!run) {
+        return Outcome::pass;
+    }
+
+    bool built = access(opts.output.c_str(), X_OK) == 0;
+    int status = built ? run_program(opts.output) : -1;
+    for (auto suffix : {"", ".qbe", ".s"}) {
+        unlink((opts.output + suffix).c_str());
+    }
+    if (!built) {
+        why = "no executable was built";
+        return Outcome::fail;
+    }
+    if (status != expect.exit_code) {
+        why = status < 0 ? "did not run to completion"
+                         : fmt::format("exited with {}, expected {}", status,
+                                       expect.exit_code);
+        return Outcome::fail;
+    }
+    return Outcome::pass;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool verbose = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            jobs = std::max(1, atoi(argv[i] + 2));
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else {
+            collect(argv[i], files);
+        }
+    }
+    if (files.empty()) {
+        collect("test", files);
+    }
+
+    Prelude prelude;
+    Runner runner{prelude};
+    runner.run = access(qbe_path().c_str(), X_OK) == 0;
+    char tmpdir[] = "/tmp/ruse-test-XXXXXX";
+    if (!mkdtemp(tmpdir)) {
+        fmt::print(stderr, "error: cannot create a scratch directory\n");
+        return EXIT_FAILURE;
+    }
+    runner.tmpdir = tmpdir;
+
+    unsigned threads = std::min<size_t>(jobs, files.size());
+    std::vector<std::unique_ptr<SemaArena>> arenas;
+    for (unsigned t = 0; t < threads; t++) {
+        arenas.push_back(std::make_unique<SemaArena>(&prelude));
+    }
+
+    size_t counts[3] = {};
+    parallel_for(threads, files.size(), [&](unsigned w, size_t i) {
+        std::string why;
+        auto outcome = runner.test(files[i], i, *arenas[w], why);
+        std::lock_guard lock{runner.output_mutex};
+        counts[static_cast<int>(outcome)]++;
+        if (outcome == Outcome::fail) {
+            fmt::print("FAIL {}: {}\n", files[i], why);
+        } else if (verbose) {
+            fmt::print("{} {}\n", outcome == Outcome::pass ? "PASS" : "SKIP",
+                       files[i]);
+        }
+    });
+    rmdir(tmpdir);
+
+    fmt::print("{} passed, {} failed, {} skipped\n", counts[0], counts[1],
+               counts[2]);
+    if (!runner.run) {
+        fmt::print("note: {} not found; programs were only typechecked\n",
+                   qbe_path());
+    }
+    return counts[1] == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
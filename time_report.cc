@@ -0,0 +1,196 @@
+#include "time_report.h"
+#include "fmt/core.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace cmp {
+
+namespace {
+
+double wall_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double cpu_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ts.tv_sec + ts.tv_nsec * 1e-9 + ru.ru_utime.tv_sec +
+           ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec +
+           ru.ru_stime.tv_usec * 1e-6;
+}
+
+const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PerfCounters::event_count] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+int perf_event_open(perf_event_attr *attr) {
+    // The calling thread, on any CPU.
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+} // namespace
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool PerfCounters::open(std::string &why) {
+    bool any = false;
+    for (int i = 0; i < event_count; i++) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        // User space only, which is all that an unprivileged process gets.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Count the typecheck workers and the external tools too.
+        attr.inherit = 1;
+        // There may be fewer hardware counters than events, in which case the
+        // kernel takes turns and the counts are scaled up in read().
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = perf_event_open(&attr);
+        if (fds[i] >= 0) {
+            any = true;
+        } else if (why.empty()) {
+            why = fmt::format("perf_event_open: {}", strerror(errno));
+        }
+    }
+    return any;
+}
+
+PerfCounters::Values PerfCounters::read() const {
+    Values v;
+    for (int i = 0; i < event_count; i++) {
+        uint64_t buf[3]; // value, time enabled, time running
+        if (fds[i] < 0 || ::read(fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+            v.count[i] = -1;
+            continue;
+        }
+        v.count[i] = buf[2] == 0 ? 0
+                                 : static_cast<int64_t>(
+                                       static_cast<double>(buf[0]) * buf[1] /
+                                       buf[2]);
+    }
+    return v;
+}
+
+Stopwatch::Stopwatch() : wall_start{wall_now()}, cpu_start{cpu_now()} {}
+
+double Stopwatch::wall() const { return wall_now() - wall_start; }
+
+double Stopwatch::cpu() const { return cpu_now() - cpu_start; }
+
+void TimeReport::add_phase(const char *phase, const Stopwatch &watch,
+                           const PerfCounters::Values *start) {
+    Phase p{phase, watch.wall(), watch.cpu(), start != nullptr, {}};
+    if (start) {
+        auto end = counters->read();
+        for (int i = 0; i < PerfCounters::event_count; i++) {
+            p.counts.count[i] = start->count[i] < 0 || end.count[i] < 0
+                                    ? -1
+                                    : end.count[i] - start->count[i];
+        }
+    }
+    phases.push_back(p);
+}
+
+void TimeReport::add_func(const char *phase, const std::string &name,
+                          double wall) {
+    funcs.push_back({phase, name, wall});
+}
+
+void TimeReport::print(const std::string &filename, FILE *out) const {
+    fmt::print(out, "=== time report for {} ===\n", filename);
+    fmt::print(out, "  {:<16} {:>10} {:>10}\n", "phase", "wall ms", "cpu ms");
+    double wall = 0, cpu = 0;
+    for (auto &p : phases) {
+        fmt::print(out, "  {:<16} {:>10.3f} {:>10.3f}\n", p.name, p.wall * 1e3,
+                   p.cpu * 1e3);
+        wall += p.wall;
+        cpu += p.cpu;
+    }
+    fmt::print(out, "  {:<16} {:>10.3f} {:>10.3f}\n", "total", wall * 1e3,
+               cpu * 1e3);
+
+    if (counters) {
+        fmt::print(out, "  {:<16}", "phase");
+        for (auto &e : perf_events) {
+            fmt::print(out, " {:>14}", e.name);
+        }
+        fmt::print(out, " {:>6}\n", "IPC");
+        for (auto &p : phases) {
+            if (!p.has_counts) {
+                continue;
+            }
+            fmt::print(out, "  {:<16}", p.name);
+            for (auto count : p.counts.count) {
+                if (count < 0) {
+                    fmt::print(out, " {:>14}", "-");
+                } else {
+                    fmt::print(out, " {:>14}", count);
+                }
+            }
+            auto cyc = p.counts.count[PerfCounters::cycles];
+            auto ins = p.counts.count[PerfCounters::instructions];
+            if (cyc > 0 && ins >= 0) {
+                fmt::print(out, " {:>6.2f}\n", static_cast<double>(ins) / cyc);
+            } else {
+                fmt::print(out, " {:>6}\n", "-");
+            }
+        }
+    }
+
+    // Slowest functions of each phase, in the order the phases ran.
+    for (auto &p : phases) {
+        std::vector<const Func *> slowest;
+        for (auto &f : funcs) {
+            if (strcmp(f.phase, p.name) == 0) {
+                slowest.push_back(&f);
+            }
+        }
+        if (slowest.empty()) {
+            continue;
+        }
+        size_t n = std::min(top_n, slowest.size());
+        std::partial_sort(slowest.begin(), slowest.begin() + n, slowest.end(),
+                          [](const Func *a, const Func *b) {
+                              return a->wall > b->wall;
+                          });
+        fmt::print(out, "  slowest functions in {} (of {}):\n", p.name,
+                   slowest.size());
+        for (size_t i = 0; i < n; i++) {
+            fmt::print(out, "    {:<24} {:>10.3f}\n", slowest[i]->name,
+                       slowest[i]->wall * 1e3);
+        }
+    }
+}
+
+} // namespace cmp
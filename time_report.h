@@ -0,0 +1,122 @@
+// -*- C++ -*-
+#ifndef CMP_TIME_REPORT_H
+#define CMP_TIME_REPORT_H
+
+#include "alloc_profile.h"
+#include "trace.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace cmp {
+
+// Wall time and CPU time since construction.  CPU time is that of the whole
+// process, plus that of the child processes it has waited for, so that it
+// covers the external tools too.
+class Stopwatch {
+public:
+    Stopwatch();
+    double wall() const;
+    double cpu() const;
+
+private:
+    double wall_start;
+    double cpu_start;
+};
+
+// Hardware performance counters of the calling thread, and of the threads and
+// processes it starts after open(), for -fperf-counters.
+class PerfCounters {
+public:
+    enum Event {
+        cycles,
+        instructions,
+        l1d_misses,
+        llc_misses,
+        branch_misses,
+        event_count,
+    };
+    struct Values {
+        // -1 for the events the hardware or the kernel do not count.
+        int64_t count[event_count];
+    };
+
+    PerfCounters() = default;
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+
+    // Start counting.  Return false and set `why` if none of the events can
+    // be counted, e.g. because perf_event_paranoid does not allow it.
+    bool open(std::string &why);
+    Values read() const;
+
+private:
+    int fds[event_count] = {-1, -1, -1, -1, -1};
+};
+
+// Where the time of a compilation went, for -ftime-report.
+class TimeReport {
+public:
+    // Number of slowest functions to list for each phase.
+    size_t top_n;
+    // Counters to report for each phase, if any.
+    const PerfCounters *counters = nullptr;
+
+    TimeReport(size_t top_n) : top_n{top_n} {}
+
+    void add_phase(const char *phase, const Stopwatch &watch,
+                   const PerfCounters::Values *start = nullptr);
+    // `phase` must outlive the report, e.g. be a string literal.
+    void add_func(const char *phase, const std::string &name, double wall);
+    void print(const std::string &filename, FILE *out = stderr) const;
+
+private:
+    struct Phase {
+        const char *name;
+        double wall;
+        double cpu;
+        bool has_counts;
+        PerfCounters::Values counts;
+    };
+    struct Func {
+        const char *phase;
+        std::string name;
+        double wall;
+    };
+    std::vector<Phase> phases;
+    std::vector<Func> funcs;
+};
+
+// Time the enclosing scope as `phase` of `report`, if there is one, trace it
+// as a span, and count its allocations against it.
+class PhaseTimer {
+public:
+    PhaseTimer(TimeReport *report, const char *phase)
+        : report{report}, phase{phase} {}
+    ~PhaseTimer() {
+        if (report) {
+            report->add_phase(phase, watch,
+                              report->counters ? &start : nullptr);
+        }
+    }
+
+private:
+    TimeReport *report;
+    const char *phase;
+    PerfCounters::Values start = report && report->counters
+                                     ? report->counters->read()
+                                     : PerfCounters::Values{};
+    // Started last, so that reading the counters is not timed.
+    Stopwatch watch;
+#ifdef RUSE_TRACING
+    TraceSpan span{"phase", phase};
+#endif
+#ifdef RUSE_ALLOC_PROFILE
+    AllocPhase alloc{phase};
+#endif
+};
+
+} // namespace cmp
+
+#endif
@@ -0,0 +1,76 @@
+#include "trace.h"
+#include "fmt/core.h"
+#include <atomic>
+#include <time.h>
+#include <unistd.h>
+
+namespace cmp {
+
+Tracer *tracer = nullptr;
+
+namespace {
+
+// Small, stable ids for the threads, in the order they first trace.
+int thread_id() {
+    static std::atomic<int> next_id{1};
+    thread_local int id = next_id++;
+    return id;
+}
+
+std::string json_escape(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += fmt::format("\\u{:04x}", c);
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+int64_t trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+void Tracer::complete(const char *cat, const char *name, const char *detail,
+                      int64_t start) {
+    int64_t end = trace_clock();
+    int tid = thread_id();
+    std::lock_guard lock{mutex};
+    events.push_back({cat, name, detail ? detail : "", start, end - start, tid});
+}
+
+bool Tracer::write(const std::string &path) const {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    std::lock_guard lock{mutex};
+    int pid = getpid();
+    fmt::print(f, "{{\"traceEvents\": [");
+    for (size_t i = 0; i < events.size(); i++) {
+        auto &e = events[i];
+        fmt::print(f,
+                   "{}\n{{\"ph\": \"X\", \"cat\": \"{}\", \"name\": \"{}\", "
+                   "\"ts\": {}, \"dur\": {}, \"pid\": {}, \"tid\": {}",
+                   i == 0 ? "" : ",", e.cat, e.name, e.start, e.duration, pid,
+                   e.tid);
+        if (!e.detail.empty()) {
+            fmt::print(f, ", \"args\": {{\"detail\": \"{}\"}}",
+                       json_escape(e.detail));
+        }
+        fmt::print(f, "}}");
+    }
+    fmt::print(f, "\n]}}\n");
+    return fclose(f) == 0;
+}
+
+} // namespace cmp
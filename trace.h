@@ -0,0 +1,83 @@
+// -*- C++ -*-
+#ifndef CMP_TRACE_H
+#define CMP_TRACE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cmp {
+
+// Collects spans of compiler work as Chrome trace events, to be viewed in
+// chrome://tracing or ui.perfetto.dev.  Spans are made with TRACE_SCOPE and
+// TRACE_SPAN, which compile to nothing unless RUSE_TRACING is defined, and
+// otherwise cost one branch when no trace is being taken.
+class Tracer {
+public:
+    // Add a span of `name` in category `cat` from `start` until now, on the
+    // calling thread.  `detail`, if not null, is shown as its argument.
+    void complete(const char *cat, const char *name, const char *detail,
+                  int64_t start);
+    // Write all spans to `path` in the JSON trace format.
+    bool write(const std::string &path) const;
+
+private:
+    struct Event {
+        const char *cat;
+        const char *name;
+        std::string detail;
+        int64_t start;
+        int64_t duration;
+        int tid;
+    };
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+};
+
+// The trace being taken, if any.
+extern Tracer *tracer;
+
+// Microseconds on a monotonic clock.
+int64_t trace_clock();
+
+// A span that lasts until the end of the enclosing scope.
+class TraceSpan {
+public:
+    TraceSpan(const char *cat, const char *name, const char *detail = nullptr)
+        : cat{cat}, name{name}, detail{detail},
+          start{tracer ? trace_clock() : 0} {}
+    ~TraceSpan() {
+        if (tracer) {
+            tracer->complete(cat, name, detail, start);
+        }
+    }
+    // Set the argument of the span, for when it is only known at the end.
+    void set_detail(const char *d) { detail = d; }
+
+private:
+    const char *cat;
+    const char *name;
+    const char *detail;
+    int64_t start;
+};
+
+} // namespace cmp
+
+#ifdef RUSE_TRACING
+#define RUSE_TRACE_CONCAT2(a, b) a##b
+#define RUSE_TRACE_CONCAT(a, b) RUSE_TRACE_CONCAT2(a, b)
+// TRACE_SCOPE(cat, name[, detail])
+#define TRACE_SCOPE(...)                                                       \
+    ::cmp::TraceSpan RUSE_TRACE_CONCAT(trace_span_, __LINE__) { __VA_ARGS__ }
+// TRACE_SPAN(var, cat, name[, detail]): a span that can be referred to as
+// `var` by TRACE_DETAIL.
+#define TRACE_SPAN(var, ...) ::cmp::TraceSpan var{__VA_ARGS__}
+#define TRACE_DETAIL(var, detail) var.set_detail(detail)
+#else
+#define TRACE_SCOPE(...) ((void)0)
+#define TRACE_SPAN(var, ...) ((void)0)
+#define TRACE_DETAIL(var, detail) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include "types.h"
+#include "alloc_profile.h"
+#include "concurrent_name_table.h"
+#include <algorithm>
+#include <atomic>
+
+namespace cmp {
+
+// Text arena chunk size.  Names longer than this get a chunk of their own.
+constexpr size_t NAME_TEXT_CHUNK_SIZE = 16 * 1024;
+
+// 64-bit FNV-1a.
+uint64_t NameTable::hash(std::string_view sv) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (char c : sv) {
+        h ^= static_cast<unsigned char>(c);
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
+
+size_t NameTable::probe(std::string_view sv, uint64_t h) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const Slot &slot = slots[i];
+        if (!slot.name) {
+            return i;
+        }
+        if (slot.hash == h && slot.name->len == sv.size() &&
+            memcmp(slot.name->text, sv.data(), sv.size()) == 0) {
+            return i;
+        }
+    }
+}
+
+Name *NameTable::get(std::string_view sv, uint64_t h) const {
+    if (base) {
+        if (Name *name = base->get(sv, h)) {
+            return name;
+        }
+    }
+    if (slots.empty()) {
+        return nullptr;
+    }
+    return slots[probe(sv, h)].name;
+}
+
+Name *NameTable::pushlen(const char *s, size_t len, uint64_t h) {
+    std::string_view sv{s, len};
+    if (base) {
+        if (Name *name = base->get(sv, h)) {
+            return name;
+        }
+    }
+    ALLOC_SCOPE(name_table);
+
+    // Keep the load factor under 1/2 so that probe sequences stay short.
+    if ((names.size() + 1) * 2 > slots.size()) {
+        grow();
+    }
+
+    Slot &slot = slots[probe(sv, h)];
+    if (slot.name) {
+        return slot.name;
+    }
+    slot.hash = h;
+    slot.name = names.make(Name{copy_text(s, len), static_cast<uint32_t>(len),
+                                id_base + static_cast<uint32_t>(names.size())});
+    return slot.name;
+}
+
+void NameTable::clear() {
+    names.reset();
+    std::fill(slots.begin(), slots.end(), Slot{});
+    // Keep the first chunk, which is at least the default size.
+    if (!text_chunks.empty()) {
+        text_chunks.resize(1);
+        text_cur = text_chunks[0].get();
+        text_end = text_cur + NAME_TEXT_CHUNK_SIZE;
+    }
+    text_used = 0;
+}
+
+void NameTable::swap(NameTable &other) {
+    assert(base == other.base);
+    slots.swap(other.slots);
+    names.swap(other.names);
+    text_chunks.swap(other.text_chunks);
+    std::swap(text_cur, other.text_cur);
+    std::swap(text_end, other.text_end);
+    std::swap(text_used, other.text_used);
+}
+
+void NameTable::grow() {
+    std::vector<Slot> old = std::move(slots);
+    slots.assign(old.empty() ? 256 : old.size() * 2, Slot{});
+    size_t mask = slots.size() - 1;
+    for (const Slot &o : old) {
+        if (!o.name) {
+            continue;
+        }
+        size_t i = o.hash & mask;
+        while (slots[i].name) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = o;
+    }
+}
+
+const char *NameTable::copy_text(const char *s, size_t len) {
+    size_t need = len + 1;
+    if (static_cast<size_t>(text_end - text_cur) < need) {
+        size_t size = std::max(need, NAME_TEXT_CHUNK_SIZE);
+        text_chunks.emplace_back(new char[size]);
+        text_cur = text_chunks.back().get();
+        text_end = text_cur + size;
+    }
+    char *text = text_cur;
+    memcpy(text, s, len);
+    text[len] = '\0';
+    text_cur += need;
+    text_used += need;
+    return text;
+}
+
+namespace {
+
+// Per-thread cache of recent ConcurrentNameTable lookups.
+struct NameCacheEntry {
+    uint64_t table_id = 0;
+    uint64_t hash = 0;
+    Name *name = nullptr;
+};
+constexpr size_t NAME_CACHE_SIZE = 1024;
+thread_local NameCacheEntry name_cache[NAME_CACHE_SIZE];
+
+std::atomic<uint64_t> next_table_id{1};
+
+} // namespace
+
+ConcurrentNameTable::ConcurrentNameTable() : id(next_table_id++) {}
+
+Name *ConcurrentNameTable::pushlen(const char *s, size_t len) {
+    uint64_t h = NameTable::hash({s, len});
+
+    auto &entry = name_cache[(h >> 16) % NAME_CACHE_SIZE];
+    if (entry.table_id == id && entry.hash == h && entry.name->len == len &&
+        memcmp(entry.name->text, s, len) == 0) {
+        return entry.name;
+    }
+
+    Shard &shard = shard_of(h);
+    Name *name;
+    {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        size_t count = shard.table.size();
+        name = shard.table.pushlen(s, len, h);
+        // Shards number their Names independently, so renumber new ones from
+        // a table-wide counter to keep ids unique.
+        if (shard.table.size() != count) {
+            name->id = next_name_id++;
+        }
+    }
+    entry = NameCacheEntry{id, h, name};
+    return name;
+}
+
+Name *ConcurrentNameTable::get(std::string_view sv) const {
+    uint64_t h = NameTable::hash(sv);
+    const Shard &shard = shard_of(h);
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    return shard.table.get(sv, h);
+}
+
+size_t ConcurrentNameTable::size() const {
+    size_t n = 0;
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        n += shard.table.size();
+    }
+    return n;
+}
+
+} // namespace cmp
@@ -2,12 +2,14 @@
 #ifndef CMP_TYPES_H
 #define CMP_TYPES_H
 
+#include "pool.h"
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -28,41 +30,85 @@ struct FuncDecl;
 // 'Name' corresponds to a single unique identifier string in the source text.
 // There may be multiple occurrences of a string in the source text, but only
 // one instance of the matching Name can reside in the name table.
+//
+// Each Name also carries a dense integer 'id', assigned in interning order, so
+// that per-Name data such as the current symbol binding can be kept in flat
+// arrays indexed by it (see ShadowTable).
 struct Name {
-    const char *text;
+    const char *text; // null-terminated
+    uint32_t len;
+    uint32_t id;
 };
 
 // 'NameTable' is a hash table of Names queried by their string value.  It
 // serves to reduce the number of string hashing operation, since we can look
 // up the symbol table using Name instead of raw char * throughout the semantic
 // analysis.
-struct NameTable {
-    Name *push(const char *s) {
-        return pushlen(s, strlen(s));
-    }
-    Name *pushlen(const char *s, size_t len) {
-        Name *found = get(std::string{s, len});
-        if (found)
-            return found;
+//
+// The table is open-addressed with linear probing, and each slot caches the
+// full hash of its string so that most mismatches and all rehashes never touch
+// the text.  Names and their text are stored in arenas that never move, so a
+// Name * stays valid across table growth.
+//
+// A table can be layered on top of a `base` table, whose Names it returns as
+// its own.  The base is only read, so it can be shared by any number of
+// tables at once, as long as it is not modified meanwhile.
+class NameTable {
+public:
+    NameTable() = default;
+    explicit NameTable(const NameTable *base)
+        : base{base},
+          id_base{base ? base->id_base + static_cast<uint32_t>(base->size())
+                       : 0} {}
+    NameTable(const NameTable &) = delete;
+    NameTable &operator=(const NameTable &) = delete;
 
-        Name n{strndup(s, len)};
-        auto pair = map.insert({std::string{s, len}, n});
-        return &pair.first->second;
-    }
-    Name *get(const std::string &s) {
-        auto found = map.find(s);
-        if (found == map.end()) {
-            return nullptr;
-        } else {
-            return &found->second;
-        }
-    }
-    ~NameTable() {
-        for (auto &m : map) {
-            free((void *)m.second.text);
-        }
+    Name *push(const char *s) { return pushlen(s, strlen(s)); }
+    Name *pushlen(const char *s, size_t len) {
+        return pushlen(s, len, hash({s, len}));
     }
-    std::unordered_map<std::string, Name> map;
+    Name *get(std::string_view sv) const { return get(sv, hash(sv)); }
+
+    // Variants that take a precomputed `h`, which must equal hash(s).
+    Name *pushlen(const char *s, size_t len, uint64_t h);
+    Name *get(std::string_view sv, uint64_t h) const;
+
+    // Number of names interned in this table, not counting the base.
+    size_t size() const { return names.size(); }
+    // Bytes used by the text of all names, including the terminators.
+    size_t text_bytes() const { return text_used; }
+    // Bytes reserved by the hash table itself.
+    size_t table_bytes() const { return slots.capacity() * sizeof(Slot); }
+
+    // Remove all names, but keep the memory for the next ones.  Invalidates
+    // every Name * from this table.
+    void clear();
+    // Exchange the contents of two tables with the same base.
+    void swap(NameTable &other);
+
+    static uint64_t hash(std::string_view sv);
+
+private:
+    struct Slot {
+        uint64_t hash = 0;
+        Name *name = nullptr;
+    };
+
+    // Return the index of the slot where `sv` either resides or should be
+    // inserted.
+    size_t probe(std::string_view sv, uint64_t h) const;
+    void grow();
+    const char *copy_text(const char *s, size_t len);
+
+    const NameTable *base = nullptr;
+    // Ids of the Names in this table start from here, after those of the base.
+    uint32_t id_base = 0;
+    std::vector<Slot> slots;
+    SlabPool<Name> names;
+    std::vector<std::unique_ptr<char[]>> text_chunks;
+    char *text_cur = nullptr;
+    char *text_end = nullptr;
+    size_t text_used = 0;
 };
 
 enum class TypeKind {
@@ -85,7 +131,8 @@ enum class TypeKind {
 // storing them in memory pools or the scoped table.
 struct Type {
     TypeKind kind = TypeKind::value;
-    // Name of the type. TODO: include & or [] in the name?
+    // Name of the type.  Null for derived types, whose names are spelled out
+    // on demand by str().
     Name *name = nullptr;
     // Whether this is a builtin type or not.
     bool builtin = false;
@@ -108,9 +155,10 @@ struct Type {
     Type(TypeKind k, Name *n, Decl *td) : kind(k), name(n), type_decl(td) {}
     // Reference types.
     // TODO: copyable?
-    Type(Name *n, TypeKind ptr_kind, Type *referee_type);
+    Type(TypeKind ptr_kind, Type *referee_type);
 
-    std::string str() const { return name->text; }
+    // Source spelling of the type, e.g. 'var *S'.  Meant for diagnostics.
+    std::string str() const;
 
     // Returns true if this type is a builtin type.
     bool is_builtin(Sema &sema) const;
@@ -0,0 +1,115 @@
+// Unit tests of the compiler data structures, for the cases that the test
+// programs cannot reach reliably.
+//
+// Usage: ruse-unit [Catch options]
+
+#include "catch.hpp"
+#include "scoped_table.h"
+
+using namespace cmp;
+
+namespace {
+
+// Puts every key in the same bucket.
+struct CollidingHash {
+    uint64_t operator()(const int *) const { return 0; }
+};
+
+using CollidingTable = ScopedTable<const int *, int, CollidingHash>;
+
+// Number of symbols in the bucket of every key, checking the back links on the
+// way.
+size_t chain_length(const CollidingTable &table) {
+    size_t n = 0;
+    const CollidingTable::Symbol *prev = nullptr;
+    for (auto s = table.keys[0]; s; s = s->next) {
+        CHECK(s->prev == prev);
+        prev = s;
+        n++;
+    }
+    return n;
+}
+
+} // namespace
+
+// Symbols of different scopes interleave in one bucket chain, and closing a
+// scope has to unlink its symbols from the middle of the chain.
+TEST_CASE("ScopedTable unlinks symbols from a shared bucket",
+          "[scoped_table]") {
+    int a, b, c;
+    CollidingTable table;
+
+    table.scope_open();
+    table.insert(&a, 1);
+    table.insert(&b, 2);
+    table.scope_open();
+    table.insert(&a, 3);
+    table.insert(&c, 4);
+    table.scope_open();
+    table.insert(&b, 5);
+    CHECK(chain_length(table) == 5);
+    CHECK(table.find(&b)->value == 5);
+
+    table.scope_close();
+    CHECK(chain_length(table) == 4);
+    CHECK(table.find(&a)->value == 3);
+    CHECK(table.find(&b)->value == 2);
+    CHECK(table.find(&c)->value == 4);
+
+    // Reopen a scope at the same level after some of it was unlinked.
+    table.scope_close();
+    table.scope_open();
+    table.insert(&c, 6);
+    CHECK(chain_length(table) == 3);
+    CHECK(table.find(&a)->value == 1);
+    CHECK(table.find(&c)->value == 6);
+
+    table.scope_close();
+    CHECK(chain_length(table) == 2);
+    CHECK(table.find(&a)->value == 1);
+    CHECK(table.find(&b)->value == 2);
+    CHECK(table.find(&c) == nullptr);
+
+    table.scope_close();
+    CHECK(chain_length(table) == 0);
+    CHECK(table.find(&a) == nullptr);
+    CHECK(table.live_count == 0);
+}
+
+// Growing the bucket array while scopes are open redistributes the symbols of
+// all of them, which closing the scopes afterwards has to cope with.
+TEST_CASE("ScopedTable grows across open scopes", "[scoped_table]") {
+    constexpr int n = 3 * SYMBOL_TABLE_INITIAL_BUCKET_COUNT;
+    int keys[n];
+    ScopedTable<const int *, int> table;
+
+    table.scope_open();
+    for (int i = 0; i < n / 2; i++) {
+        table.insert(&keys[i], i);
+    }
+    table.scope_open();
+    // Shadow every other outer key, and add new ones.
+    for (int i = 0; i < n / 2; i += 2) {
+        table.insert(&keys[i], -i);
+    }
+    for (int i = n / 2; i < n; i++) {
+        table.insert(&keys[i], i);
+    }
+    CHECK(table.keys.size() > SYMBOL_TABLE_INITIAL_BUCKET_COUNT);
+    CHECK(table.find(&keys[2])->value == -2);
+    CHECK(table.find(&keys[n - 1])->value == n - 1);
+
+    table.scope_close();
+    for (int i = 0; i < n; i++) {
+        auto s = table.find(&keys[i]);
+        if (i < n / 2) {
+            REQUIRE(s != nullptr);
+            CHECK(s->value == i);
+        } else {
+            CHECK(s == nullptr);
+        }
+    }
+    table.scope_close();
+    CHECK(table.find(&keys[0]) == nullptr);
+    CHECK(table.live_count == 0);
+}